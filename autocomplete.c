@@ -3,27 +3,48 @@
 #include <string.h>
 #include <unistd.h>
 #include <glob.h>
+#include <dirent.h>
+#include <math.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <sys/uio.h>
 #include <sys/stat.h>
+#include <sys/queue.h>
 #include <arpa/inet.h>
 #include <unicode/uloc.h>
 #include <unicode/utypes.h>
 #include <unicode/ustring.h>
+#include <unicode/ubrk.h>
+#include <unicode/unorm2.h>
+#include <unicode/uchar.h>
 #include "uthash.h"
 #include "utstring.h"
-#include "json/json.h"
+#include "utlist.h"
+#include "fold.h"
 #include <signal.h>
 #include <time.h>
+#include <sys/time.h>
 #include <event.h>
 #include <evhttp.h>
 #include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #define NAME "autocomplete"
 #define VERSION "0.3"
 #define DEBUG 1
 #define DEFAULT_PORT 8080
+#define DEFAULT_LIMIT 100
+#define MAX_MSEARCH 32
+#define MAX_FUZZY 2
+#define MAX_CURSORS 4096
+#define CURSOR_TTL 30
+#define SLOW_RING 256
 #define EMPTY_STRING ""
 #define KEY_LEN(k) (k->len[0] + k->len[1] + 1)
 
@@ -53,27 +74,181 @@ typedef struct composite_key {
     char data[1];
 } composite_key;
 
+struct trie;
+
 typedef struct el {
     composite_key *ckey;
+    struct namespace *ns;
     char *data;
     time_t when;
     int count;
+    char *frag;         /* rendered JSON, see el_frag() */
+    int frag_split;     /* when and count go between frag[0..split) and the rest */
+    int frag_len;
+    int heap_idx;       /* position in ns->heap */
+    double score;       /* eviction order, lowest goes first */
+    double frecency;    /* log2 of the decayed hit sum, see frecency_add() */
+    struct el **rank_next;  /* skiplist links, see rank_insert() */
+    int rank_levels;
+    time_t expires;     /* 0 for never */
+    struct el **wheel_list;     /* timer wheel slot holding e, see wheel_add() */
+    struct el *prev, *next;     /* wheel slot, or the reap list once nuked */
+    struct trie *trie;          /* node for e's key, see trie_insert() */
+    struct el *trie_next, **trie_prev;
+    struct token *tokens;       /* word starts, see words_insert() */
+    int ntokens;
+    uint32_t gid;       /* id in the trigram index, see grams_insert() */
     UT_hash_handle hh;  /* handle for key hash */
     UT_hash_handle rh;  /* handle for results hash */
 } el;
 
+/*
+ *  One word start of an element's key, filed in the word trie under
+ *  the rest of the key from there.
+ */
+struct token {
+    struct el *e;
+    struct trie *node;
+    struct token *next, **prev;
+    int off;    /* bytes into the key */
+};
+
+/*
+ *  Result orders for the sort arg; newest first unless asked otherwise.
+ */
+enum {
+    SORT_TIME,
+    SORT_FRECENCY
+};
+
+/*
+ *  What the key arg matches, see the match arg: the start of the key,
+ *  the start of any word in it, or anywhere in it.
+ */
+enum {
+    MATCH_PREFIX,
+    MATCH_WORD,
+    MATCH_INFIX
+};
+
+/*
+ *  One search, as parsed from /search or one section of /msearch.
+ *  Strings point into the request's parsed args.
+ */
+struct query {
+    char *namespace;
+    char *key;
+    char *id;
+    char *locale;
+    char *cursor;       /* "1" opens a cursor, a token refines one */
+    int limit;
+    int sort;
+    int match;
+    int fuzzy;          /* edits allowed, see fuzzy_search() */
+    time_t when;
+    char next_cursor[17];
+};
+
+/*
+ *  What a namespace's heap is spent on, see ns_charge().
+ */
+enum {
+    MEM_ELEMS,
+    MEM_KEYS,
+    MEM_DATA,
+    MEM_FRAGS,
+    MEM_HASH,
+    MEM_INDEX,
+    MEM_NAMESPACE,
+    NMEM
+};
+
+const char *mem_names[NMEM] = {"elements", "keys", "data", "fragments", "hash", "index", "namespace"};
+
+/*
+ *  Which element goes when a namespace is full. Scores only change
+ *  when an element is put, so they live in a per namespace min heap.
+ *  Frecency halves the weight of each hit every FRECENCY_HALF_LIFE
+ *  seconds. Rather than decaying every score as time passes, each hit
+ *  is weighted 2^(when / half life) and the score is the log2 of their
+ *  sum: decaying all scores by the same factor doesn't change their
+ *  order, so the score is fixed between puts and never rescaled.
+ */
+enum {
+    POLICY_LRU,
+    POLICY_LFU,
+    POLICY_FRECENCY,
+    NPOLICIES
+};
+
+const char *policy_names[NPOLICIES] = {"lru", "lfu", "frecency"};
+
+#define FRECENCY_HALF_LIFE (7 * 86400.0)
+#define RANK_LEVELS 16
+
+int find_policy(const char *name)
+{
+    int i;
+
+    for (i=0; i < NPOLICIES; i++) {
+        if (strcmp(name, policy_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ *  How keys are normalized, see the -n option: lowercased, or folded
+ *  so that width, compatibility forms, accents and case don't matter.
+ */
+enum {
+    NORM_LOWER,
+    NORM_FOLD,
+    NNORMS
+};
+
+const char *norm_names[NNORMS] = {"lower", "fold"};
+
 struct namespace {
     char *name;
     int nelems;
     int dirty;
+    int pinned;         /* being flushed, see save_namespaces() */
+    int64_t bytes;      /* sum of mem */
+    int64_t mem[NMEM];
+    int max_elems;      /* 0 for the global -e default */
+    int policy;
+    int ttl;            /* default for puts without one, 0 for none */
+    time_t next_expiry; /* no element expires before, see expire_check() */
+    int configured;     /* has a .conf, see save_namespace() */
+    struct el **heap;
+    int heap_len;
+    int heap_size;
+    uint64_t version;   /* bumped on every change, see bump_version() */
     pthread_mutex_t lock;
     struct el *elems;
+    struct el *ranked[RANK_LEVELS];  /* by frecency, built on first use */
+    int rank_built;
+    struct trie *trie;  /* by key, built on first nuke, fuzzy or short infix search */
+    struct trie *words; /* by word start, built on first match=word search */
+    int infix;          /* match=infix allowed, see grams_insert() */
+    struct gram *grams; /* by trigram, built on first match=infix search */
+    struct el **gram_elems; /* by gid, NULL once removed */
+    uint32_t gram_len;
+    uint32_t gram_size;
+    uint32_t gram_dead;
+    int compact_queued; /* in compacting, see compact_check() */
+    struct el *compact_elems;   /* moved so far, see compact_namespace() */
+    struct el *compact_next;    /* next in elems to move */
+    struct namespace *prev, *next;  /* lru, most recent first */
     UT_hash_handle hh;  /* handle for key hash */
     UT_hash_handle dh;  /* handle for dirty hash */
+    UT_hash_handle ch;  /* handle for compacting */
 };
 
 struct evhttp *httpd;
-struct namespace *spaces = NULL;
+struct namespace *spaces = NULL, *spaces_lru = NULL;
 struct event backup_timer;
 struct timeval backup_tv = {60, 0};
 static pthread_mutex_t master_lock;
@@ -81,12 +256,30 @@ static pthread_cond_t backup_cond;
 char *default_locale = ULOC_US;
 char *db_dir = NULL;
 int max_elems = 1000;
+int default_policy = POLICY_LRU;
+int normalize = NORM_LOWER;
+int frag_cache = 0;
+size_t results_cache_max = 16 << 20;
+int64_t mem_budget = 0;
+int64_t ns_quota = 0;
+int64_t ns_bytes = 0;
+int64_t mem_total[NMEM];
+uint64_t generation = 0;
 int is_running = 1;
+uint64_t last_flush_bytes = 0;
 
 void load_namespace(char *namespace);
+void compact_finish(struct namespace *ns);
+uint64_t fnv1a(const char *s, int len);
 void put_cb(struct evhttp_request *req, void *arg);
 void search_cb(struct evhttp_request *req, void *arg);
 void del_cb(struct evhttp_request *req, void *arg);
+void msearch_cb(struct evhttp_request *req, void *arg);
+void stats_cb(struct evhttp_request *req, void *arg);
+void metrics_cb(struct evhttp_request *req, void *arg);
+void slow_cb(struct evhttp_request *req, void *arg);
+void memory_cb(struct evhttp_request *req, void *arg);
+void config_cb(struct evhttp_request *req, void *arg);
 
 
 uint16_t crc16(const uint8_t *buffer, int size) {
@@ -115,9 +308,490 @@ char *utstring_varappend(UT_string *ustr, ...)
     return utstring_body(ustr);
 }
 
-char *namespace_path(UT_string *path, char *namespace)
+/*
+ *  Latency histograms, HDR style: each power of two is split into
+ *  HIST_SUB linear buckets, so any value is recorded to within 1/8th.
+ *  Updates are three atomic adds and a compare and swap loop for the
+ *  max, safe from any thread; a reader may see them half applied.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (40 * HIST_SUB)
+
+enum {
+    STAT_PUT,
+    STAT_DEL,
+    STAT_NUKE,
+    STAT_SEARCH,
+    STAT_MSEARCH,
+    STAT_CONFIG,
+    STAT_NORMALIZE,
+    STAT_NS_LOOKUP,
+    STAT_LOCK_WAIT,
+    STAT_SELECT,
+    STAT_SORT,
+    STAT_SERIALIZE,
+    STAT_LOAD,
+    STAT_FLUSH,
+    NSTATS
+};
+
+const char *stat_names[NSTATS] = {
+    "put", "del", "nuke", "search", "msearch", "config",
+    "normalize", "ns_lookup", "lock_wait", "select", "sort", "serialize",
+    "load", "flush"
+};
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} stats[NSTATS];
+
+/*
+ *  What one request did, for the slow log. A request handler points
+ *  cur_trace at one for its duration; the phases fill it in as they go.
+ */
+struct trace {
+    char namespace[64];
+    int prefix_len;
+    int scanned;
+    int matches;
+    int results;
+    int cold_load;
+    uint32_t phases[NSTATS];
+};
+
+__thread struct trace *cur_trace = NULL;
+
+/*
+ *  Set while load_namespace() replays a file, so the normalize and lock
+ *  waits of each element it puts aren't recorded as the request's own;
+ *  the whole load is recorded as STAT_LOAD instead.
+ */
+__thread int loading = 0;
+
+uint64_t now_usec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int hist_bucket(uint64_t v)
+{
+    int msb, shift, i;
+
+    if (v < HIST_SUB) {
+        return v;
+    }
+    msb = 63 - __builtin_clzll(v);
+    shift = msb - HIST_SUB_BITS;
+    i = (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+/*
+ *  Largest value that lands in bucket i.
+ */
+uint64_t hist_value(int i)
+{
+    int shift;
+
+    if (i < HIST_SUB) {
+        return i;
+    }
+    shift = i / HIST_SUB - 1;
+    return ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+}
+
+void stat_record(int stat, uint64_t usec)
+{
+    struct histogram *h = &stats[stat];
+    uint64_t max;
+
+    if (loading) {
+        return;
+    }
+    __sync_fetch_and_add(&h->count, 1);
+    __sync_fetch_and_add(&h->sum, usec);
+    __sync_fetch_and_add(&h->buckets[hist_bucket(usec)], 1);
+    while ((max = h->max) < usec && !__sync_bool_compare_and_swap(&h->max, max, usec));
+    if (cur_trace) {
+        cur_trace->phases[stat] += usec;
+    }
+}
+
+void trace_begin(struct trace *t, char *namespace, char *key)
+{
+    memset(t, 0, sizeof(*t));
+    if (namespace) {
+        snprintf(t->namespace, sizeof(t->namespace), "%s", namespace);
+    }
+    t->prefix_len = key ? strlen(key) : 0;
+    cur_trace = t;
+}
+
+/*
+ *  The last SLOW_RING requests that took longer than slow_usec. Only
+ *  the event thread reads or writes it.
+ */
+struct slow_entry {
+    time_t when;
+    int stat;
+    uint64_t usec;
+    struct trace trace;
+};
+
+struct slow_entry slow_ring[SLOW_RING];
+uint64_t slow_count = 0;
+uint64_t slow_usec = 100000;
+
+void record_slow(int stat, uint64_t usec, struct trace *t)
+{
+    struct slow_entry *s = &slow_ring[slow_count++ % SLOW_RING];
+
+    s->when = time(NULL);
+    s->stat = stat;
+    s->usec = usec;
+    s->trace = *t;
+}
+
+/*
+ *  Records the time since start and returns now, so phases chain:
+ *    t = stat_since(STAT_SELECT, t);
+ *    t = stat_since(STAT_SORT, t);
+ */
+uint64_t stat_since(int stat, uint64_t start)
+{
+    uint64_t now = now_usec();
+
+    stat_record(stat, now - start);
+    return now;
+}
+
+uint64_t hist_percentile(struct histogram *h, uint64_t count, double p)
+{
+    uint64_t seen = 0, want = count * p;
+    int i;
+
+    for (i=0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > want) {
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+        }
+    }
+    return h->max;
+}
+
+/*
+ *  Counters are kept per thread and only written by their owner, so
+ *  the hot path is a plain add. Readers sum across threads and may see
+ *  a slightly stale total, but never block anyone.
+ */
+enum {
+    C_NAMESPACES,
+    C_ELEMS,
+    C_ELEM_BYTES,
+    C_DIRTIED,
+    C_FLUSHED,
+    C_FLUSH_BYTES,
+    C_MASTER_CONTENDED,
+    C_NS_CONTENDED,
+    C_NS_EVICTED,
+    C_EXPIRED,
+    C_COMPACTED,
+    NCOUNTERS
+};
+
+struct counters {
+    int64_t v[NCOUNTERS];
+    struct counters *next;
+};
+
+struct counters *all_counters = NULL;
+__thread struct counters *thread_counters = NULL;
+
+struct counters *my_counters()
+{
+    struct counters *c = thread_counters;
+
+    if (!c) {
+        c = malloc(sizeof(*c));
+        memset(c, 0, sizeof(*c));
+        do {
+            c->next = all_counters;
+        } while (!__sync_bool_compare_and_swap(&all_counters, c->next, c));
+        thread_counters = c;
+    }
+    return c;
+}
+
+#define count_add(i, n) (my_counters()->v[i] += (n))
+
+int64_t count_sum(int i)
 {
-    char buf[7];
+    struct counters *c;
+    int64_t sum = 0;
+
+    for (c=all_counters; c != NULL; c=c->next) {
+        sum += c->v[i];
+    }
+    return sum;
+}
+
+/*
+ *  Logging never blocks the caller. Lines are formatted straight into a
+ *  bounded multi-producer ring (one sequence number per slot, after
+ *  Vyukov) and a writer thread drains it to stderr in batches. If the
+ *  ring is full the line is dropped and counted.
+ */
+#define LOG_RING 4096
+#define LOG_LINE_MAX 512
+
+enum {
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+};
+
+const char *log_levels[] = {"error", "warn", "info", "debug"};
+
+struct log_slot {
+    uint64_t seq;
+    int fd;
+    int len;
+    char line[LOG_LINE_MAX];
+};
+
+struct log_slot log_ring[LOG_RING];
+uint64_t log_head = 0, log_tail = 0, log_dropped = 0;
+int log_level = LOG_INFO;
+int log_sample = 1;
+int log_running = 0;
+int capture_fd = -1;
+pthread_t log_tid;
+
+struct log_slot *log_reserve()
+{
+    struct log_slot *slot;
+    uint64_t pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    int64_t dif;
+
+    for (;;) {
+        slot = &log_ring[pos % LOG_RING];
+        dif = (int64_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (int64_t)pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                return slot;
+            }
+        } else if (dif < 0) {
+            __sync_fetch_and_add(&log_dropped, 1);
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void log_publish(struct log_slot *slot)
+{
+    uint64_t pos = slot->seq;
+
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ *  Appends s as a quoted logfmt value, truncating to fit.
+ */
+int log_quote(char *dst, int len, int max, const char *s)
+{
+    if (len < max) {
+        dst[len++] = '"';
+    }
+    for (; *s && len < max - 2; s++) {
+        if (*s == '"' || *s == '\\') {
+            dst[len++] = '\\';
+        } else if (*s == '\n') {
+            dst[len++] = '\\';
+            dst[len++] = 'n';
+            continue;
+        }
+        dst[len++] = *s;
+    }
+    if (len < max) {
+        dst[len++] = '"';
+    }
+    return len;
+}
+
+int log_prefix(char *dst, int level)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return snprintf(dst, LOG_LINE_MAX, "time=%ld.%06ld level=%s ", (long)tv.tv_sec,
+                    (long)tv.tv_usec, log_levels[level]);
+}
+
+void log_msg(int level, const char *fmt, ...)
+{
+    struct log_slot *slot;
+    char msg[LOG_LINE_MAX];
+    va_list argp;
+    int len;
+
+    if (level > log_level || !(slot = log_reserve())) {
+        return;
+    }
+    va_start(argp, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, argp);
+    va_end(argp);
+    len = log_prefix(slot->line, level);
+    len += snprintf(slot->line + len, LOG_LINE_MAX - len, "msg=");
+    len = log_quote(slot->line, len, LOG_LINE_MAX - 1, msg);
+    slot->line[len++] = '\n';
+    slot->fd = 2;
+    slot->len = len;
+    log_publish(slot);
+}
+
+/*
+ *  With -C every request is also written, unsampled, to the capture
+ *  file as "<start usec> <uri>" for loadgen -r to replay. URIs too long
+ *  for a slot are dropped rather than truncated.
+ */
+void log_capture(struct evhttp_request *req, uint64_t start)
+{
+    struct log_slot *slot;
+    int len;
+
+    if (capture_fd == -1 || !(slot = log_reserve())) {
+        return;
+    }
+    len = snprintf(slot->line, LOG_LINE_MAX, "%llu %s\n", (unsigned long long)start, req->uri);
+    if (len >= LOG_LINE_MAX) {
+        __sync_fetch_and_add(&log_dropped, 1);
+        len = 0;
+    }
+    slot->fd = capture_fd;
+    slot->len = len;
+    log_publish(slot);
+}
+
+/*
+ *  One line per request, sampled 1 in log_sample. Anything other than
+ *  200 is always logged. results < 0 means the endpoint has none.
+ *  Also records the request's latency histogram.
+ */
+void log_access(struct evhttp_request *req, int stat, int results, uint64_t start)
+{
+    static unsigned int seen = 0;
+    struct log_slot *slot;
+    uint64_t usec = now_usec() - start;
+    int len;
+
+    stat_record(stat, usec);
+    log_capture(req, start);
+    if (cur_trace) {
+        cur_trace->results = results > 0 ? results : 0;
+        if (slow_usec && usec >= slow_usec) {
+            record_slow(stat, usec, cur_trace);
+        }
+        cur_trace = NULL;
+    }
+    if (log_level < LOG_INFO || (req->response_code == HTTP_OK && seen++ % log_sample != 0)) {
+        return;
+    }
+    if (!(slot = log_reserve())) {
+        return;
+    }
+    len = log_prefix(slot->line, LOG_INFO);
+    len += snprintf(slot->line + len, LOG_LINE_MAX - len, "endpoint=%s status=%d usec=%llu ",
+                    stat_names[stat], req->response_code, (unsigned long long)usec);
+    if (results >= 0) {
+        len += snprintf(slot->line + len, LOG_LINE_MAX - len, "results=%d ", results);
+    }
+    len += snprintf(slot->line + len, LOG_LINE_MAX - len, "uri=");
+    len = log_quote(slot->line, len, LOG_LINE_MAX - 1, req->uri);
+    slot->line[len++] = '\n';
+    slot->fd = 2;
+    slot->len = len;
+    log_publish(slot);
+}
+
+/*
+ *  Drains the ring into batched writes, one batch per run of lines
+ *  bound for the same fd. Sleeps briefly when idle rather than having
+ *  producers signal it.
+ */
+void *log_thread(void *ctx)
+{
+    static char out[64 * 1024];
+    struct log_slot *slot;
+    struct timespec idle = {0, 5000000};
+    int n, drained, fd = 2, running;
+
+    do {
+        running = log_running;
+        n = drained = 0;
+        for (;;) {
+            slot = &log_ring[log_tail % LOG_RING];
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_tail + 1) {
+                break;
+            }
+            if (n && (n + slot->len > sizeof(out) || slot->fd != fd)) {
+                write(fd, out, n);
+                n = 0;
+            }
+            fd = slot->fd;
+            memcpy(out + n, slot->line, slot->len);
+            n += slot->len;
+            drained++;
+            __atomic_store_n(&slot->seq, log_tail + LOG_RING, __ATOMIC_RELEASE);
+            log_tail++;
+        }
+        if (n) {
+            write(fd, out, n);
+        } else if (!drained && running) {
+            nanosleep(&idle, NULL);
+        }
+    } while (running || drained);
+    return NULL;
+}
+
+void log_start()
+{
+    int i;
+
+    for (i=0; i < LOG_RING; i++) {
+        log_ring[i].seq = i;
+    }
+    log_running = 1;
+    pthread_create(&log_tid, NULL, log_thread, NULL);
+}
+
+/*
+ *  Flushes whatever is queued and stops the writer.
+ */
+void log_stop()
+{
+    log_running = 0;
+    pthread_join(log_tid, NULL);
+}
+
+/*
+ *  A crc directory holds each namespace's data file, named after it,
+ *  and its side files, named "." + name + ext. Names starting with '.'
+ *  or '%' get a '%' in front on disk, so no data file starts with '.'
+ *  and a side file can never be some namespace's data.
+ */
+char *namespace_file(UT_string *path, char *namespace, const char *ext)
+{
+    char buf[8];
     union {
         uint16_t i;
         uint8_t s[2];
@@ -125,10 +799,20 @@ char *namespace_path(UT_string *path, char *namespace)
     
     crc.i = crc16((const uint8_t *)namespace, strlen(namespace));
     sprintf(buf, "/%hx/%hx/", crc.s[0], crc.s[1]);
-    utstring_varappend(path, db_dir, buf, namespace, NULL);
+    if (ext) {
+        utstring_varappend(path, db_dir, buf, ".", namespace, ext, NULL);
+    } else {
+        utstring_varappend(path, db_dir, buf, namespace[0] == '.' || namespace[0] == '%' ? "%" : "",
+                           namespace, NULL);
+    }
     return utstring_body(path);
 }
 
+char *namespace_path(UT_string *path, char *namespace)
+{
+    return namespace_file(path, namespace, NULL);
+}
+
 void make_nested_dirs()
 {
     int i, j;
@@ -157,42 +841,387 @@ void make_nested_dirs()
     utstring_free(path);
 }
 
-struct namespace *get_namespace(char *namespace)
+/*
+ *  Bloom filter of namespaces that exist on disk, so a search for a
+ *  name that was never put is answered without an open() or creating
+ *  the namespace. 10 bits and 7 probes per name, about 1% false
+ *  positives, which just fall through to a load that finds nothing.
+ *  Built from the db directory at startup and only touched by the
+ *  event thread after that. A full filter can't be resized without
+ *  the names, so puts past its capacity start a new one twice the
+ *  size, with a few more bits per name to keep the false positives of
+ *  them all together near 1%. Names are checked against every one.
+ */
+#define BLOOM_BITS_PER_NAME 10
+#define BLOOM_PROBES 7
+#define BLOOM_MIN_NAMES (64 * 1024)
+
+struct bloom {
+    uint64_t *bits;
+    uint64_t nbits;
+    int bits_per_name;
+    int64_t names;
+    int64_t capacity;
+    struct bloom *next;     /* the smaller one before it */
+};
+
+struct bloom *blooms = NULL;    /* newest first, names go in it */
+uint64_t bloom_nbits = 0;
+int64_t bloom_names = 0;
+
+void bloom_new(int64_t capacity, int bits_per_name)
 {
-    struct namespace *ns = NULL;
-    pthread_mutex_lock(&master_lock);
-    HASH_FIND_STR(spaces, namespace, ns);
-    pthread_mutex_unlock(&master_lock);
-    return ns;
+    struct bloom *b = malloc(sizeof(*b));
+
+    b->capacity = capacity;
+    b->bits_per_name = bits_per_name;
+    b->nbits = capacity * bits_per_name;
+    b->bits = calloc((b->nbits + 63) / 64, sizeof(uint64_t));
+    b->names = 0;
+    b->next = blooms;
+    blooms = b;
+    bloom_nbits += b->nbits;
 }
 
-struct namespace *create_namespace(char *namespace, int *new)
+void bloom_add(const char *name)
 {
-    struct namespace *ns = NULL;
+    uint64_t h1 = fnv1a(name, strlen(name));
+    uint64_t h2 = ((h1 >> 33) | (h1 << 31)) | 1;
+    uint64_t b;
+    int i;
 
-    if (new) {
-        *new = 0;
+    for (i=0; i < BLOOM_PROBES; i++) {
+        b = (h1 + i * h2) % blooms->nbits;
+        blooms->bits[b / 64] |= 1ULL << (b % 64);
     }
-    HASH_FIND_STR(spaces, namespace, ns);
-    if (!ns) {
-        /*
-         *  This works because only one thread is ever adding namespaces.
-         */
-        if (new) {
-            *new = 1;
-        }
-        ns = malloc(sizeof(*ns));
-        memset(ns, 0, sizeof(*ns));
+    blooms->names++;
+    bloom_names++;
+}
+
+int bloom_check(const char *name)
+{
+    uint64_t h1 = fnv1a(name, strlen(name));
+    uint64_t h2 = ((h1 >> 33) | (h1 << 31)) | 1;
+    uint64_t b;
+    struct bloom *f;
+    int i;
+
+    for (f=blooms; f; f=f->next) {
+        for (i=0; i < BLOOM_PROBES; i++) {
+            b = (h1 + i * h2) % f->nbits;
+            if (!(f->bits[b / 64] & (1ULL << (b % 64)))) {
+                break;
+            }
+        }
+        if (i == BLOOM_PROBES) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ *  Calls fn for every namespace file under db_dir.
+ */
+void scan_namespaces(void (*fn)(const char *name))
+{
+    DIR *dir;
+    struct dirent *d;
+    UT_string *path;
+    int i, j;
+    char sub[8];
+
+    utstring_new(path);
+    for (i=0; i<256; i++) {
+        for (j=0; j<256; j++) {
+            sprintf(sub, "/%hx/%hx", i, j);
+            utstring_clear(path);
+            utstring_varappend(path, db_dir, sub, NULL);
+            if (!(dir = opendir(utstring_body(path)))) {
+                continue;
+            }
+            while ((d = readdir(dir)) != NULL) {
+                if (d->d_name[0] == '.') {
+                    /* side files, see namespace_file() */
+                    continue;
+                }
+                fn(d->d_name[0] == '%' ? d->d_name + 1 : d->d_name);
+            }
+            closedir(dir);
+        }
+    }
+    utstring_free(path);
+}
+
+/*
+ *  True if the first len bytes of name hash to db directory i/j.
+ */
+int in_crc_dir(const char *name, int len, int i, int j)
+{
+    union {
+        uint16_t i;
+        uint8_t s[2];
+    } crc;
+
+    crc.i = crc16((const uint8_t *)name, len);
+    return crc.s[0] == i && crc.s[1] == j;
+}
+
+/*
+ *  Renames files left by older builds, which named a data file after
+ *  its namespace as is and its config name + ".conf", to what
+ *  namespace_file() expects, and drops their unfinished ".tmp" files.
+ *  A file is only taken for an old one if the name it implies hashes
+ *  to its directory, and nothing is overwritten. Run at startup,
+ *  before anything else reads the db directory.
+ */
+void upgrade_namespaces()
+{
+    DIR *dir;
+    struct dirent *d;
+    UT_string *path, *from, *to;
+    int i, j, len, moved = 0, dropped = 0;
+    char sub[8];
+
+    utstring_new(path);
+    utstring_new(from);
+    utstring_new(to);
+    for (i=0; i<256; i++) {
+        for (j=0; j<256; j++) {
+            sprintf(sub, "/%hx/%hx/", i, j);
+            utstring_clear(path);
+            utstring_varappend(path, db_dir, sub, NULL);
+            if (!(dir = opendir(utstring_body(path)))) {
+                continue;
+            }
+            while ((d = readdir(dir)) != NULL) {
+                len = strlen(d->d_name);
+                utstring_clear(from);
+                utstring_varappend(from, utstring_body(path), d->d_name, NULL);
+                utstring_clear(to);
+                if (in_crc_dir(d->d_name, len, i, j)) {
+                    if (d->d_name[0] == '.' || d->d_name[0] == '%') {
+                        utstring_varappend(to, utstring_body(path), "%", d->d_name, NULL);
+                    }
+                } else if (len > 9 && strcmp(d->d_name + len - 9, ".conf.tmp") == 0 &&
+                           in_crc_dir(d->d_name, len - 9, i, j)) {
+                    dropped += unlink(utstring_body(from)) == 0;
+                } else if (len > 5 && strcmp(d->d_name + len - 5, ".conf") == 0 &&
+                           in_crc_dir(d->d_name, len - 5, i, j)) {
+                    utstring_varappend(to, utstring_body(path), ".", d->d_name, NULL);
+                } else if (len > 4 && strcmp(d->d_name + len - 4, ".tmp") == 0 &&
+                           in_crc_dir(d->d_name, len - 4, i, j)) {
+                    dropped += unlink(utstring_body(from)) == 0;
+                }
+                if (utstring_len(to) && access(utstring_body(to), F_OK) != 0) {
+                    if (rename(utstring_body(from), utstring_body(to)) == 0) {
+                        moved++;
+                    } else {
+                        log_msg(LOG_ERROR, "rename failed: %s: %s", utstring_body(from), strerror(errno));
+                    }
+                }
+            }
+            closedir(dir);
+        }
+    }
+    utstring_free(path);
+    utstring_free(from);
+    utstring_free(to);
+    if (moved || dropped) {
+        log_msg(LOG_INFO, "upgraded db dir: %d files renamed, %d unfinished files removed", moved, dropped);
+    }
+}
+
+void count_name(const char *name)
+{
+    bloom_names++;
+}
+
+/*
+ *  Sizes the filter for twice the names on disk and fills it. Only
+ *  run at startup, it reads every db directory.
+ */
+void bloom_build()
+{
+    int64_t names;
+
+    bloom_names = 0;
+    scan_namespaces(count_name);
+    names = bloom_names;
+    bloom_names = 0;
+    bloom_new(names * 2 > BLOOM_MIN_NAMES ? names * 2 : BLOOM_MIN_NAMES, BLOOM_BITS_PER_NAME);
+    scan_namespaces(bloom_add);
+    log_msg(LOG_INFO, "bloom filter: %lld namespaces, %llu bits", (long long)bloom_names,
+            (unsigned long long)bloom_nbits);
+}
+
+/*
+ *  For namespaces about to be written for the first time.
+ */
+void bloom_remember(char *namespace)
+{
+    if (blooms && !bloom_check(namespace)) {
+        if (blooms->names >= blooms->capacity) {
+            bloom_new(blooms->capacity * 2, blooms->bits_per_name + 3);
+            log_msg(LOG_INFO, "bloom filter: %lld namespaces, %llu bits", (long long)bloom_names,
+                    (unsigned long long)bloom_nbits);
+        }
+        bloom_add(namespace);
+    }
+}
+
+void lock_master()
+{
+    if (pthread_mutex_trylock(&master_lock) != 0) {
+        count_add(C_MASTER_CONTENDED, 1);
+        pthread_mutex_lock(&master_lock);
+    }
+}
+
+/*
+ *  Versions come from one process wide counter, so a namespace that is
+ *  dropped and loaded again never reuses a version a client has seen.
+ */
+void bump_version(struct namespace *ns)
+{
+    ns->version = __sync_add_and_fetch(&generation, 1);
+}
+
+struct namespace *get_namespace(char *namespace)
+{
+    struct namespace *ns = NULL;
+    uint64_t start = now_usec();
+
+    lock_master();
+    HASH_FIND_STR(spaces, namespace, ns);
+    pthread_mutex_unlock(&master_lock);
+    stat_since(STAT_NS_LOOKUP, start);
+    return ns;
+}
+
+/*
+ *  Every allocation made for a namespace is charged to it, by kind,
+ *  for the -m budget, the -q quota and /debug/memory. Only the event
+ *  thread changes elements, so plain adds are enough.
+ */
+void ns_charge(struct namespace *ns, int what, int64_t n)
+{
+    ns->mem[what] += n;
+    ns->bytes += n;
+    mem_total[what] += n;
+    ns_bytes += n;
+}
+
+/*
+ *  uthash allocates its table and bucket array behind our back, so
+ *  recharge the difference after anything that adds or deletes.
+ */
+void hash_charge(struct namespace *ns)
+{
+    int64_t n = 0;
+
+    if (ns->elems) {
+        n = sizeof(UT_hash_table) + ns->elems->hh.tbl->num_buckets * sizeof(UT_hash_bucket);
+    }
+    if (ns->compact_elems) {
+        n += sizeof(UT_hash_table) + ns->compact_elems->hh.tbl->num_buckets * sizeof(UT_hash_bucket);
+    }
+    ns_charge(ns, MEM_HASH, n - ns->mem[MEM_HASH]);
+}
+
+/*
+ *  While a namespace is being compacted its elements are split
+ *  between two tables, see compact_namespace().
+ */
+struct el *find_el(struct namespace *ns, composite_key *ckey)
+{
+    struct el *e;
+
+    HASH_FIND(hh, ns->elems, ckey->data, KEY_LEN(ckey), e);
+    if (!e && ns->compact_elems) {
+        HASH_FIND(hh, ns->compact_elems, ckey->data, KEY_LEN(ckey), e);
+    }
+    return e;
+}
+
+unsigned count_els(struct namespace *ns)
+{
+    return HASH_COUNT(ns->elems) + HASH_COUNT(ns->compact_elems);
+}
+
+/*
+ *  Walks both tables in element order, the moved ones first.
+ */
+struct el *first_el(struct namespace *ns)
+{
+    return ns->compact_elems ? ns->compact_elems : ns->elems;
+}
+
+struct el *next_el(struct namespace *ns, struct el *e)
+{
+    if (!e->hh.next && ns->compact_elems && e->hh.tbl == ns->compact_elems->hh.tbl) {
+        return ns->elems;
+    }
+    return e->hh.next;
+}
+
+struct namespace *create_namespace(char *namespace, int *new)
+{
+    struct namespace *ns = NULL;
+    uint64_t start = now_usec();
+
+    if (new) {
+        *new = 0;
+    }
+    HASH_FIND_STR(spaces, namespace, ns);
+    if (ns && ns != spaces_lru) {
+        DL_DELETE(spaces_lru, ns);
+        DL_PREPEND(spaces_lru, ns);
+    }
+    if (!ns) {
+        /*
+         *  This works because only one thread is ever adding namespaces.
+         */
+        if (new) {
+            *new = 1;
+        }
+        ns = malloc(sizeof(*ns));
+        memset(ns, 0, sizeof(*ns));
         ns->name = safe_strdup(namespace);
+        ns->policy = default_policy;
         pthread_mutex_init(&ns->lock, NULL);
-        pthread_mutex_lock(&master_lock);
+        bump_version(ns);
+        ns_charge(ns, MEM_NAMESPACE, sizeof(*ns) + strlen(ns->name) + 1);
+        lock_master();
         HASH_ADD_KEYPTR(hh, spaces, ns->name, strlen(ns->name), ns);
         pthread_mutex_unlock(&master_lock);
+        DL_PREPEND(spaces_lru, ns);
+        count_add(C_NAMESPACES, 1);
+        if (cur_trace) {
+            cur_trace->cold_load = 1;
+        }
         load_namespace(namespace);
     }
+    stat_since(STAT_NS_LOOKUP, start);
     return ns;
 }
 
+void lock_namespace(struct namespace *ns)
+{
+    uint64_t start = now_usec();
+
+    if (pthread_mutex_trylock(&ns->lock) != 0) {
+        count_add(C_NS_CONTENDED, 1);
+        pthread_mutex_lock(&ns->lock);
+    }
+    stat_since(STAT_LOCK_WAIT, start);
+}
+
+int frecency_sort(el *a, el *b)
+{
+    return a->frecency > b->frecency ? -1 : a->frecency < b->frecency;
+}
+
 int time_count_sort(el *a, el *b) {
     if (a->when > b->when) {
         return -1;
@@ -208,472 +1237,3443 @@ int time_count_sort(el *a, el *b) {
     return 0;
 }
 
-void free_el(struct el *e)
+/*
+ *  Approximate heap held by an element.
+ */
+int64_t el_size(struct el *e)
 {
-    if (e) {
-        safe_free(e->data);
-        safe_free(e->ckey);
-        free(e);
+    return sizeof(*e) + sizeof(*e->ckey) + KEY_LEN(e->ckey) +
+        (e->data ? strlen(e->data) + 1 : 0) + (e->frag ? e->frag_len : 0);
+}
+
+/*
+ *  Charges (sign 1) or credits (sign -1) an element to its namespace.
+ */
+void el_charge(struct el *e, int sign)
+{
+    count_add(C_ELEM_BYTES, sign * el_size(e));
+    ns_charge(e->ns, MEM_ELEMS, sign * (int64_t)sizeof(*e));
+    ns_charge(e->ns, MEM_KEYS, sign * (int64_t)(sizeof(*e->ckey) + KEY_LEN(e->ckey)));
+    if (e->data) {
+        ns_charge(e->ns, MEM_DATA, sign * (int64_t)(strlen(e->data) + 1));
+    }
+    if (e->frag) {
+        ns_charge(e->ns, MEM_FRAGS, sign * (int64_t)e->frag_len);
     }
 }
 
-char *utf8_tolower(char *s, char *locale)
+/*
+ *  Rough size of an element before it exists, to turn away puts that
+ *  could never fit the -q quota without normalizing anything.
+ */
+int64_t el_estimate(char *key, char *id, char *data)
 {
-    UChar *buf = NULL;
-    char *buf2 = NULL;
-    UErrorCode err = U_ZERO_ERROR;
-    int32_t len = 0, len2 = 0;
+    return sizeof(struct el) + sizeof(composite_key) + strlen(key) + 1 +
+        (id ? strlen(id) : 0) + 1 + (data ? strlen(data) + 1 : 0);
+}
 
-    u_strFromUTF8(NULL, 0, &len, s, -1, &err);
-    buf = malloc(sizeof(UChar) * len+1);
-    memset(buf, 0, sizeof(UChar) * len+1);
-    err = U_ZERO_ERROR;
-    u_strFromUTF8(buf, len+1, NULL, s, -1, &err);
-    if (U_FAILURE(err)) {
-        fprintf(stderr, "u_strFromUTF8 failed: %s: %s\n", s, u_errorName(err));
-        free(buf);
-        return NULL;
-    }
+void wheel_del(struct el *e);
 
-    err = U_ZERO_ERROR;
-    len2 = u_strToLower(NULL, 0, (UChar *)buf, -1, locale, &err);
-    if (len2 > len) {
-        buf = realloc(buf, sizeof(UChar *) * len2+1);
-        memset(buf, 0, sizeof(UChar) * len2+1);
+/*
+ *  Takes e off the timer wheel and out of its namespace's accounting,
+ *  leaving only the memory, see release_el().
+ */
+void uncharge_el(struct el *e)
+{
+    wheel_del(e);
+    count_add(C_ELEMS, -1);
+    el_charge(e, -1);
+    if (e->rank_next) {
+        ns_charge(e->ns, MEM_INDEX, -(int64_t)(e->rank_levels * sizeof(*e->rank_next)));
     }
-    err = U_ZERO_ERROR;
-    u_strToLower(buf, len2+1, (UChar *)buf, -1, locale, &err);
-    if (U_FAILURE(err)) {
-        fprintf(stderr, "u_strToLower failed: %s: %s\n", s, u_errorName(err));
-        free(buf);
-        return NULL;
+    if (e->tokens) {
+        ns_charge(e->ns, MEM_INDEX, -(int64_t)(e->ntokens * sizeof(*e->tokens)));
     }
+}
 
-    err = U_ZERO_ERROR;
-    u_strToUTF8(NULL, 0, &len, buf, -1, &err);
-    buf2 = malloc(sizeof(char *) * len+1);
-    memset(buf2, 0, sizeof(char *) * len+1);
-    err = U_ZERO_ERROR;
-    u_strToUTF8(buf2, len+1, &len, (UChar *)buf, -1, &err);
-    if (U_FAILURE(err)) {
-        fprintf(stderr, "u_strToUTF8 failed: %s: %s\n", s, u_errorName(err));
-        free(buf);
-        free(buf2);
-        return NULL;
-    }
-    free(buf);
-    return buf2;
+void release_el(struct el *e)
+{
+    safe_free(e->tokens);
+    safe_free(e->rank_next);
+    safe_free(e->data);
+    safe_free(e->frag);
+    safe_free(e->ckey);
+    free(e);
 }
 
-composite_key *make_key(char *locale, char *key, char *id)
+void free_el(struct el *e)
 {
-    composite_key *ckey = NULL;
-    char *normalized_key;
-    int klen, ilen;
-    
-    if (!key) {
-        key = EMPTY_STRING;
-    }
-    if (!id) {
-        id = EMPTY_STRING;
+    if (e) {
+        uncharge_el(e);
+        release_el(e);
     }
-    normalized_key = utf8_tolower(key, locale);
-    if (normalized_key) {
-        klen = strlen(normalized_key);
-        ilen = strlen(id);
-        ckey = malloc(sizeof(*ckey) + klen + ilen + 1);
-        ckey->key = ckey->data;
-        strncpy(ckey->key, normalized_key, klen+1);
-        ckey->id = ckey->data + klen + 1;
-        strncpy(ckey->id, id, ilen+1);
-        ckey->len[0] = klen;
-        ckey->len[1] = ilen;
-        safe_free(normalized_key);
+}
+
+double el_score(struct namespace *ns, struct el *e)
+{
+    switch (ns->policy) {
+        case POLICY_LFU:
+            /* count first, recency breaks ties */
+            return e->count + e->when * 1e-10;
+        case POLICY_FRECENCY:
+            return e->frecency;
+        default:
+            return e->when;
     }
-    return ckey;
 }
 
-void print_el(struct el *e)
+void heap_swap(struct namespace *ns, int i, int j)
 {
-    fprintf(stderr, "%s:%s\n\tdata %s\n\twhen %ld\n\tcount %d\n", e->ckey->key,
-            e->ckey->id, e->data, e->when, e->count);
+    struct el *tmp = ns->heap[i];
+
+    ns->heap[i] = ns->heap[j];
+    ns->heap[j] = tmp;
+    ns->heap[i]->heap_idx = i;
+    ns->heap[j]->heap_idx = j;
 }
 
-struct el *put_el(char *namespace, char *locale, char *key, char *id, char *data, time_t when, int mark)
+void heap_up(struct namespace *ns, int i)
 {
-    struct namespace *ns;
-    struct el *e = NULL;
-    composite_key *ckey;
-    int new;
+    while (i > 0 && ns->heap[i]->score < ns->heap[(i - 1) / 2]->score) {
+        heap_swap(ns, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
 
-    ckey = make_key(locale, key, id);
-    if (!ckey) {
-        return NULL;
+void heap_down(struct namespace *ns, int i)
+{
+    int min, c;
+
+    for (;;) {
+        min = i;
+        for (c=2 * i + 1; c <= 2 * i + 2 && c < ns->heap_len; c++) {
+            if (ns->heap[c]->score < ns->heap[min]->score) {
+                min = c;
+            }
+        }
+        if (min == i) {
+            return;
+        }
+        heap_swap(ns, i, min);
+        i = min;
+    }
+}
+
+void heap_insert(struct namespace *ns, struct el *e)
+{
+    if (ns->heap_len == ns->heap_size) {
+        ns->heap_size = ns->heap_size ? ns->heap_size * 2 : 16;
+        ns->heap = realloc(ns->heap, ns->heap_size * sizeof(*ns->heap));
+        ns_charge(ns, MEM_INDEX, (ns->heap_size - ns->heap_len) * sizeof(*ns->heap));
+    }
+    e->score = el_score(ns, e);
+    e->heap_idx = ns->heap_len++;
+    ns->heap[e->heap_idx] = e;
+    heap_up(ns, e->heap_idx);
+}
+
+void heap_remove(struct namespace *ns, struct el *e)
+{
+    int i = e->heap_idx;
+
+    if (i != --ns->heap_len) {
+        heap_swap(ns, i, ns->heap_len);
+        heap_up(ns, i);
+        heap_down(ns, i);
+    }
+}
+
+void heap_fix(struct namespace *ns, struct el *e)
+{
+    e->score = el_score(ns, e);
+    heap_up(ns, e->heap_idx);
+    heap_down(ns, e->heap_idx);
+}
+
+/*
+ *  log2(2^a + 2^b) without leaving the log domain.
+ */
+double frecency_add(double a, double b)
+{
+    if (a < b) {
+        return b + log1p(exp2(a - b)) / M_LN2;
+    }
+    return a + log1p(exp2(b - a)) / M_LN2;
+}
+
+/*
+ *  The frecency ranking is a skiplist, highest score first, with the
+ *  element address breaking ties so every element has one place. It
+ *  costs memory per element, so a namespace only gets one once it is
+ *  searched with sort=frecency; from then on puts keep it current.
+ */
+int rank_before(struct el *a, struct el *b)
+{
+    return a->frecency > b->frecency || (a->frecency == b->frecency && a > b);
+}
+
+void rank_insert(struct namespace *ns, struct el *e)
+{
+    struct el **next = ns->ranked;
+    int i;
+
+    if (!e->rank_next) {
+        /* one level in four goes up */
+        for (e->rank_levels=1; e->rank_levels < RANK_LEVELS &&
+                 (random() & 3) == 0; e->rank_levels++);
+        e->rank_next = malloc(e->rank_levels * sizeof(*e->rank_next));
+        ns_charge(ns, MEM_INDEX, e->rank_levels * sizeof(*e->rank_next));
+    }
+    for (i=RANK_LEVELS - 1; i >= 0; i--) {
+        while (next[i] && rank_before(next[i], e)) {
+            next = next[i]->rank_next;
+        }
+        if (i < e->rank_levels) {
+            e->rank_next[i] = next[i];
+            next[i] = e;
+        }
+    }
+}
+
+void rank_remove(struct namespace *ns, struct el *e)
+{
+    struct el **next = ns->ranked;
+    int i;
+
+    for (i=RANK_LEVELS - 1; i >= 0; i--) {
+        while (next[i] && next[i] != e && rank_before(next[i], e)) {
+            next = next[i]->rank_next;
+        }
+        if (next[i] == e) {
+            next[i] = e->rank_next[i];
+        }
+    }
+}
+
+void rank_build(struct namespace *ns)
+{
+    struct el *e, *tmp;
+
+    compact_finish(ns);
+    HASH_ITER(hh, ns->elems, e, tmp) {
+        rank_insert(ns, e);
+    }
+    ns->rank_built = 1;
+}
+
+/*
+ *  For setting e's frecency outside put_el.
+ */
+void rescore_el(struct namespace *ns, struct el *e, double frecency)
+{
+    if (ns->rank_built) {
+        rank_remove(ns, e);
+    }
+    e->frecency = frecency;
+    heap_fix(ns, e);
+    if (ns->rank_built) {
+        rank_insert(ns, e);
+    }
+}
+
+/*
+ *  Rescore everything, after the policy changed.
+ */
+void heap_rebuild(struct namespace *ns)
+{
+    int i;
+
+    for (i=0; i < ns->heap_len; i++) {
+        ns->heap[i]->score = el_score(ns, ns->heap[i]);
+    }
+    for (i=ns->heap_len / 2 - 1; i >= 0; i--) {
+        heap_down(ns, i);
+    }
+}
+
+/*
+ *  A byte trie over the normalized keys, so everything under a prefix
+ *  can be found, or cut off, without looking at the rest. Children
+ *  are kept in byte order; elements sharing a key, with different
+ *  ids, hang off its node. Like the ranking it only exists once
+ *  something needs it, and puts keep it current from then on.
+ */
+struct trie {
+    unsigned char c;
+    struct trie *parent;
+    struct trie *child;
+    struct trie *sibling;
+    struct el *elems;
+    struct token *tokens;   /* in the word trie instead of elems */
+};
+
+struct trie *trie_new(struct namespace *ns, struct trie *parent, unsigned char c)
+{
+    struct trie *t = malloc(sizeof(*t));
+
+    memset(t, 0, sizeof(*t));
+    t->c = c;
+    t->parent = parent;
+    ns_charge(ns, MEM_INDEX, sizeof(*t));
+    return t;
+}
+
+/*
+ *  The node for key[0..len), or NULL if no key starts with it.
+ */
+struct trie *trie_find(struct trie *t, const char *key, int len)
+{
+    struct trie *c;
+    int i;
+
+    for (i=0; t && i < len; i++) {
+        for (c=t->child; c && c->c < (unsigned char)key[i]; c=c->sibling);
+        t = c && c->c == (unsigned char)key[i] ? c : NULL;
+    }
+    return t;
+}
+
+/*
+ *  The node for key[0..len), made if need be.
+ */
+struct trie *trie_path(struct namespace *ns, struct trie *t, const char *key, int len)
+{
+    struct trie **c, *n;
+    unsigned char b;
+    int i;
+
+    for (i=0; i < len; i++) {
+        b = key[i];
+        for (c=&t->child; *c && (*c)->c < b; c=&(*c)->sibling);
+        if (!*c || (*c)->c != b) {
+            n = trie_new(ns, t, b);
+            n->sibling = *c;
+            *c = n;
+        }
+        t = *c;
+    }
+    return t;
+}
+
+void trie_insert(struct namespace *ns, struct el *e)
+{
+    struct trie *t = trie_path(ns, ns->trie, e->ckey->key, e->ckey->len[0]);
+
+    e->trie = t;
+    e->trie_next = t->elems;
+    if (t->elems) {
+        t->elems->trie_prev = &e->trie_next;
+    }
+    e->trie_prev = &t->elems;
+    t->elems = e;
+}
+
+/*
+ *  Cuts t from its parent and frees it and any ancestors left empty.
+ */
+void trie_prune(struct namespace *ns, struct trie *t)
+{
+    struct trie **c, *parent;
+
+    while (t->parent && !t->elems && !t->tokens && !t->child) {
+        parent = t->parent;
+        for (c=&parent->child; *c != t; c=&(*c)->sibling);
+        *c = t->sibling;
+        free(t);
+        ns_charge(ns, MEM_INDEX, -(int64_t)sizeof(*t));
+        t = parent;
+    }
+}
+
+void trie_remove(struct namespace *ns, struct el *e)
+{
+    *e->trie_prev = e->trie_next;
+    if (e->trie_next) {
+        e->trie_next->trie_prev = e->trie_prev;
+    }
+    trie_prune(ns, e->trie);
+    e->trie = NULL;
+}
+
+void trie_build(struct namespace *ns)
+{
+    struct el *e, *tmp;
+
+    compact_finish(ns);
+    ns->trie = trie_new(ns, NULL, 0);
+    HASH_ITER(hh, ns->elems, e, tmp) {
+        trie_insert(ns, e);
+    }
+}
+
+/*
+ *  The node after t in a depth first walk of the subtree under root,
+ *  or NULL when there is none. A key is a path as deep as it is long,
+ *  so walks follow the links instead of recursing.
+ */
+struct trie *trie_next(struct trie *t, struct trie *root)
+{
+    if (t->child) {
+        return t->child;
+    }
+    while (t != root && !t->sibling) {
+        t = t->parent;
+    }
+    return t == root ? NULL : t->sibling;
+}
+
+/*
+ *  Frees t and everything below it, leaving the elements alone. The
+ *  first leaf goes each time, so its parent's child link is all that
+ *  needs fixing.
+ */
+void trie_free(struct namespace *ns, struct trie *t)
+{
+    struct trie *n = t, *parent;
+
+    for (;;) {
+        while (n->child) {
+            n = n->child;
+        }
+        if (n == t) {
+            break;
+        }
+        parent = n->parent;
+        parent->child = n->sibling;
+        free(n);
+        ns_charge(ns, MEM_INDEX, -(int64_t)sizeof(*n));
+        n = parent;
+    }
+    free(t);
+    ns_charge(ns, MEM_INDEX, -(int64_t)sizeof(*t));
+}
+
+/*
+ *  Word starts are found with an ICU word break iterator: a boundary
+ *  followed by anything other than spaces or punctuation starts a
+ *  word, and so does the start of the key whatever follows it. The
+ *  iterator is kept between calls, which all come from the event
+ *  thread, and only reopened when the locale changes.
+ */
+#define MAX_TOKENS 32
+
+int word_starts(char *key, int len, char *locale, int *starts)
+{
+    static UBreakIterator *bi = NULL;
+    static char bi_locale[ULOC_FULLNAME_CAPACITY];
+    UErrorCode err = U_ZERO_ERROR;
+    UChar *buf;
+    int32_t ulen = 0, prev, b, i, off;
+    UChar32 ch;
+    int n = 0;
+
+    if (!locale) {
+        locale = (char *)uloc_getDefault();
+    }
+    if (!bi || strcmp(bi_locale, locale) != 0) {
+        if (bi) {
+            ubrk_close(bi);
+        }
+        bi = ubrk_open(UBRK_WORD, locale, NULL, 0, &err);
+        if (U_FAILURE(err)) {
+            log_msg(LOG_WARN, "ubrk_open failed: %s: %s", locale, u_errorName(err));
+            bi = NULL;
+            starts[0] = 0;
+            return 1;
+        }
+        snprintf(bi_locale, sizeof(bi_locale), "%s", locale);
+    }
+    u_strFromUTF8(NULL, 0, &ulen, key, len, &err);
+    buf = malloc(sizeof(UChar) * (ulen + 1));
+    err = U_ZERO_ERROR;
+    u_strFromUTF8(buf, ulen + 1, NULL, key, len, &err);
+    ubrk_setText(bi, buf, ulen, &err);
+    starts[n++] = 0;
+    /* walk the UTF-8 offsets along with the UTF-16 boundaries */
+    for (i=0, off=0, prev=ubrk_first(bi); n < MAX_TOKENS && (b = ubrk_next(bi)) != UBRK_DONE; prev=b) {
+        for (; i < prev; off += U8_LENGTH(ch)) {
+            U16_NEXT(buf, i, ulen, ch);
+        }
+        if (prev && ubrk_getRuleStatus(bi) != UBRK_WORD_NONE) {
+            starts[n++] = off;
+        }
+    }
+    free(buf);
+    return n;
+}
+
+/*
+ *  Always splits with the -l locale: a put's locale isn't kept, and
+ *  elements loaded from disk or indexed by words_build() must split
+ *  the same way as ones put since.
+ */
+void words_insert(struct namespace *ns, struct el *e)
+{
+    int starts[MAX_TOKENS];
+    struct token *tk;
+    int i;
+
+    e->ntokens = word_starts(e->ckey->key, e->ckey->len[0], default_locale, starts);
+    e->tokens = malloc(e->ntokens * sizeof(*e->tokens));
+    ns_charge(ns, MEM_INDEX, e->ntokens * sizeof(*e->tokens));
+    for (i=0; i < e->ntokens; i++) {
+        tk = &e->tokens[i];
+        tk->e = e;
+        tk->off = starts[i];
+        tk->node = trie_path(ns, ns->words, e->ckey->key + tk->off, e->ckey->len[0] - tk->off);
+        tk->next = tk->node->tokens;
+        if (tk->next) {
+            tk->next->prev = &tk->next;
+        }
+        tk->prev = &tk->node->tokens;
+        tk->node->tokens = tk;
+    }
+}
+
+void words_remove(struct namespace *ns, struct el *e)
+{
+    struct token *tk;
+    int i;
+
+    for (i=0; i < e->ntokens; i++) {
+        tk = &e->tokens[i];
+        *tk->prev = tk->next;
+        if (tk->next) {
+            tk->next->prev = tk->prev;
+        }
+        trie_prune(ns, tk->node);
+    }
+    ns_charge(ns, MEM_INDEX, -(int64_t)(e->ntokens * sizeof(*e->tokens)));
+    free(e->tokens);
+    e->tokens = NULL;
+    e->ntokens = 0;
+}
+
+void words_build(struct namespace *ns)
+{
+    struct el *e, *tmp;
+
+    compact_finish(ns);
+    ns->words = trie_new(ns, NULL, 0);
+    HASH_ITER(hh, ns->elems, e, tmp) {
+        words_insert(ns, e);
+    }
+}
+
+/*
+ *  True if key[0..len) starts one of e's words.
+ */
+int word_match(struct el *e, char *key, int len)
+{
+    int i;
+
+    for (i=0; i < e->ntokens; i++) {
+        if (e->ckey->len[0] - e->tokens[i].off >= len &&
+            strncmp(e->ckey->key + e->tokens[i].off, key, len) == 0) {
+            return 1;
+        }
+    }
+    return !e->tokens && strncmp(e->ckey->key, key, len) == 0;
+}
+
+/*
+ *  Adds the elements with a word under t to results, once each.
+ *  Returns how many tokens were looked at.
+ */
+int words_collect(struct trie *t, composite_key *ckey, int has_id, struct el **results)
+{
+    struct trie *node;
+    struct token *tk;
+    struct el *e;
+    int n = 0;
+
+    for (node=t; node; node=trie_next(node, t)) {
+        for (tk=node->tokens; tk; tk=tk->next, n++) {
+            if (has_id && strcmp(tk->e->ckey->id, ckey->id) != 0) {
+                continue;
+            }
+            HASH_FIND(rh, *results, tk->e->ckey->data, KEY_LEN(tk->e->ckey), e);
+            if (!e) {
+                HASH_ADD_KEYPTR(rh, *results, tk->e->ckey->data, KEY_LEN(tk->e->ckey), tk->e);
+            }
+        }
+    }
+    return n;
+}
+
+/*
+ *  Substring search for namespaces that opt in with /config infix=1.
+ *  Every element gets the next gid and is appended to the posting
+ *  list of each three byte run of its key. Since gids only grow, a
+ *  list stays sorted and is stored as varint gaps, a byte for most of
+ *  them. Removing an element only clears its gram_elems slot; the
+ *  stale ids are dropped when compact_namespace() rebuilds the index
+ *  once they outnumber the live ones.
+ */
+#define GRAM_LEN 3
+
+struct gram {
+    uint32_t g;             /* the three bytes */
+    unsigned char *buf;     /* varint gaps between gids */
+    int len;
+    int size;
+    int n;                  /* gids in buf */
+    uint32_t last;
+    UT_hash_handle hh;
+};
+
+#define gram_of(p) (((uint32_t)(unsigned char)(p)[0] << 16) | \
+                    ((uint32_t)(unsigned char)(p)[1] << 8) | (unsigned char)(p)[2])
+
+void gram_append(struct namespace *ns, uint32_t g, uint32_t gid)
+{
+    struct gram *gr;
+    uint32_t v;
+    int size;
+
+    HASH_FIND(hh, ns->grams, &g, sizeof(g), gr);
+    if (!gr) {
+        gr = malloc(sizeof(*gr));
+        memset(gr, 0, sizeof(*gr));
+        gr->g = g;
+        HASH_ADD(hh, ns->grams, g, sizeof(gr->g), gr);
+        ns_charge(ns, MEM_INDEX, sizeof(*gr));
+    } else if (gr->n && gr->last == gid) {
+        /* the run is in the key twice */
+        return;
+    }
+    if (gr->len + 5 > gr->size) {
+        size = gr->size ? gr->size * 2 : 8;
+        gr->buf = realloc(gr->buf, size);
+        ns_charge(ns, MEM_INDEX, size - gr->size);
+        gr->size = size;
+    }
+    for (v=gid - gr->last; v >= 0x80; v >>= 7) {
+        gr->buf[gr->len++] = v | 0x80;
+    }
+    gr->buf[gr->len++] = v;
+    gr->last = gid;
+    gr->n++;
+}
+
+/*
+ *  Decodes gr's gids into out, which has room for gr->n.
+ */
+int gram_decode(struct gram *gr, uint32_t *out)
+{
+    uint32_t v, gid = 0;
+    int i = 0, n = 0, shift;
+
+    while (i < gr->len) {
+        for (v=0, shift=0; gr->buf[i] & 0x80; shift += 7) {
+            v |= (uint32_t)(gr->buf[i++] & 0x7f) << shift;
+        }
+        v |= (uint32_t)gr->buf[i++] << shift;
+        gid += v;
+        out[n++] = gid;
+    }
+    return n;
+}
+
+void grams_insert(struct namespace *ns, struct el *e)
+{
+    int i, size;
+
+    if (e->gid && e->gid < ns->gram_len && !ns->gram_elems[e->gid]) {
+        /* back from unlink_el() by put_el(), its postings are all there */
+        ns->gram_elems[e->gid] = e;
+        ns->gram_dead--;
+        return;
+    }
+    if (ns->gram_len == ns->gram_size) {
+        size = ns->gram_size * 2;
+        ns->gram_elems = realloc(ns->gram_elems, size * sizeof(*ns->gram_elems));
+        ns_charge(ns, MEM_INDEX, (size - ns->gram_size) * sizeof(*ns->gram_elems));
+        ns->gram_size = size;
+    }
+    e->gid = ns->gram_len++;
+    ns->gram_elems[e->gid] = e;
+    for (i=0; i + GRAM_LEN <= e->ckey->len[0]; i++) {
+        gram_append(ns, gram_of(e->ckey->key + i), e->gid);
+    }
+}
+
+void grams_remove(struct namespace *ns, struct el *e)
+{
+    if (e->gid < ns->gram_len && ns->gram_elems[e->gid] == e) {
+        ns->gram_elems[e->gid] = NULL;
+        ns->gram_dead++;
+    }
+}
+
+void grams_free(struct namespace *ns)
+{
+    struct gram *gr, *tmp;
+
+    HASH_ITER(hh, ns->grams, gr, tmp) {
+        HASH_DEL(ns->grams, gr);
+        ns_charge(ns, MEM_INDEX, -(int64_t)(sizeof(*gr) + gr->size));
+        free(gr->buf);
+        free(gr);
+    }
+    ns_charge(ns, MEM_INDEX, -(int64_t)(ns->gram_size * sizeof(*ns->gram_elems)));
+    safe_free(ns->gram_elems);
+    ns->gram_elems = NULL;
+    ns->gram_len = ns->gram_size = ns->gram_dead = 0;
+}
+
+void grams_build(struct namespace *ns)
+{
+    struct el *e, *tmp;
+
+    if (ns->gram_elems) {
+        grams_free(ns);
+    }
+    /* gid 0 is never used, so 0 in an element means none */
+    ns->gram_size = 16;
+    ns->gram_len = 1;
+    ns->gram_elems = malloc(ns->gram_size * sizeof(*ns->gram_elems));
+    ns->gram_elems[0] = NULL;
+    ns_charge(ns, MEM_INDEX, ns->gram_size * sizeof(*ns->gram_elems));
+    compact_finish(ns);
+    HASH_ITER(hh, ns->elems, e, tmp) {
+        e->gid = 0;
+        grams_insert(ns, e);
+    }
+}
+
+/*
+ *  Sorted intersection of a and b into out, which may be a. With SSE2
+ *  four gids of each are compared against each other at a time, by
+ *  comparing a's block with b's and its three rotations, and the
+ *  block with the smaller last gid moves on.
+ */
+int gids_intersect(uint32_t *a, int na, uint32_t *b, int nb, uint32_t *out)
+{
+    int i = 0, j = 0, n = 0;
+#ifdef __SSE2__
+    __m128i va, vb, eq;
+    uint32_t amax, bmax;
+    int k, mask;
+
+    while (i + 4 <= na && j + 4 <= nb) {
+        va = _mm_loadu_si128((__m128i *)(a + i));
+        vb = _mm_loadu_si128((__m128i *)(b + j));
+        eq = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi32(va, vb),
+                         _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+            _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+                         _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))));
+        mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+        amax = a[i + 3];
+        bmax = b[j + 3];
+        for (k=0; mask; k++, mask >>= 1) {
+            if (mask & 1) {
+                out[n++] = a[i + k];
+            }
+        }
+        if (amax <= bmax) {
+            i += 4;
+        }
+        if (bmax <= amax) {
+            j += 4;
+        }
+    }
+#endif
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (a[i] > b[j]) {
+            j++;
+        } else {
+            out[n++] = a[i];
+            i++;
+            j++;
+        }
+    }
+    return n;
+}
+
+/*
+ *  Takes e out of the hash, the heap, the ranking and the indexes;
+ *  the caller frees it.
+ */
+void unlink_el(struct namespace *ns, struct el *e)
+{
+    if (ns->compact_elems && e->hh.tbl == ns->compact_elems->hh.tbl) {
+        HASH_DEL(ns->compact_elems, e);
+    } else {
+        if (e == ns->compact_next) {
+            ns->compact_next = e->hh.next;
+        }
+        HASH_DEL(ns->elems, e);
+    }
+    heap_remove(ns, e);
+    if (ns->rank_built) {
+        rank_remove(ns, e);
+    }
+    if (e->trie) {
+        trie_remove(ns, e);
+    }
+    if (e->tokens) {
+        words_remove(ns, e);
+    }
+    if (ns->gram_elems) {
+        grams_remove(ns, e);
+    }
+}
+
+/*
+ *  uthash grows a table as elements arrive but never shrinks it, and
+ *  the heap array is the same, so a namespace that was once large
+ *  keeps that footprint after a mass delete. Ones left with over
+ *  COMPACT_SLACK times the room they need are queued, and
+ *  compact_tick() rebuilds them from the event loop, up to
+ *  COMPACT_BATCH elements a second. The backup thread then hands the
+ *  freed pages back to the system, see backup_thread().
+ *
+ *  uthash doubles a table when a chain reaches HASH_BKT_CAPACITY_THRESH,
+ *  which with its hash settles at two to four elements per bucket, so
+ *  a table fits its elements while buckets * HASH_FILL <= elements.
+ */
+#define COMPACT_SLACK 4
+#define COMPACT_BATCH 65536
+#define HASH_FILL 2
+
+struct namespace *compacting = NULL;
+struct event compact_timer;
+struct timeval compact_tv = {1, 0};
+volatile int trim_wanted = 0;
+
+int oversized(struct namespace *ns)
+{
+    return (ns->elems && ns->elems->hh.tbl->num_buckets > HASH_INITIAL_NUM_BUCKETS &&
+            (uint64_t)ns->elems->hh.tbl->num_buckets * HASH_FILL > COMPACT_SLACK * (uint64_t)count_els(ns)) ||
+        ns->heap_size > COMPACT_SLACK * (ns->heap_len > 16 ? ns->heap_len : 16) ||
+        (ns->gram_dead > 1024 && ns->gram_dead > ns->gram_len - ns->gram_dead);
+}
+
+/*
+ *  After elements were removed.
+ */
+void compact_check(struct namespace *ns)
+{
+    if (!ns->compact_queued && oversized(ns)) {
+        ns->compact_queued = 1;
+        HASH_ADD_KEYPTR(ch, compacting, ns->name, strlen(ns->name), ns);
+    }
+}
+
+/*
+ *  Moves up to max elements into a fresh table, which grows to fit
+ *  them as they go in. Between calls the rest wait in ns->elems from
+ *  ns->compact_next on, and puts land there behind them, so element
+ *  order is kept; find_el() and count_els() look at both tables. Once
+ *  ns->elems is empty the fresh table replaces it, the heap array is
+ *  shrunk, and a trigram index with more removed gids than live ones
+ *  is rebuilt. Call with ns->lock held. Returns how many elements
+ *  were moved, and sets *done once the namespace is compacted.
+ */
+int compact_namespace(struct namespace *ns, int max, int *done)
+{
+    struct el *e;
+    int n = 0, size;
+
+    if (!ns->compact_elems) {
+        ns->compact_next = ns->elems;
+    }
+    while (ns->compact_next && n < max) {
+        e = ns->compact_next;
+        ns->compact_next = e->hh.next;
+        HASH_DELETE(hh, ns->elems, e);
+        HASH_ADD_KEYPTR(hh, ns->compact_elems, e->ckey->data, KEY_LEN(e->ckey), e);
+        n++;
+    }
+    if ((*done = !ns->compact_next)) {
+        ns->elems = ns->compact_elems;
+        ns->compact_elems = NULL;
+        for (size=16; size < ns->heap_len * 2; size *= 2);
+        if (size < ns->heap_size) {
+            ns->heap = realloc(ns->heap, size * sizeof(*ns->heap));
+            ns_charge(ns, MEM_INDEX, -(int64_t)((ns->heap_size - size) * sizeof(*ns->heap)));
+            ns->heap_size = size;
+        }
+        if (ns->gram_elems && ns->gram_dead > ns->gram_len - ns->gram_dead) {
+            grams_build(ns);
+        }
+    }
+    hash_charge(ns);
+    return n;
+}
+
+/*
+ *  For whatever needs every element in ns->elems, like building an
+ *  index, which walks them all anyway.
+ */
+void compact_finish(struct namespace *ns)
+{
+    int done;
+
+    if (ns->compact_elems) {
+        compact_namespace(ns, count_els(ns), &done);
+        HASH_DELETE(ch, compacting, ns);
+        ns->compact_queued = 0;
+        count_add(C_COMPACTED, 1);
+    }
+}
+
+void compact_tick(int fd, short event, void *arg)
+{
+    struct namespace *ns, *tmp;
+    int n = 0, done;
+
+    HASH_ITER(ch, compacting, ns, tmp) {
+        if (n >= COMPACT_BATCH) {
+            break;
+        }
+        lock_namespace(ns);
+        n += compact_namespace(ns, COMPACT_BATCH - n, &done) + 1;
+        pthread_mutex_unlock(&ns->lock);
+        if (done) {
+            HASH_DELETE(ch, compacting, ns);
+            ns->compact_queued = 0;
+            count_add(C_COMPACTED, 1);
+        }
+    }
+    if (n) {
+        trim_wanted = 1;
+    }
+    evtimer_set(&compact_timer, compact_tick, NULL);
+    evtimer_add(&compact_timer, &compact_tv);
+}
+
+/*
+ *  Elements with a ttl sit in a hierarchical timer wheel: level l
+ *  holds what expires within WHEEL_SLOTS^(l+1) seconds, in slots of
+ *  WHEEL_SLOTS^l seconds. expire_tick() advances it once a second,
+ *  moving a slot of level l+1 down whenever level l wraps around, so
+ *  an element is touched a handful of times between put and expiry
+ *  and nothing ever walks a namespace looking for expired ones. Like
+ *  the results cache, the wheel belongs to the event thread.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+#define EXPIRE_BATCH 256    /* per event loop pass, see expire_tick() */
+
+#define el_expired(e, now) ((e)->expires && (e)->expires <= (now))
+
+struct el *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+struct el *expiring = NULL;     /* due, freed EXPIRE_BATCH at a time */
+time_t wheel_now = 0;
+struct event expire_timer;
+struct timeval expire_tv = {1, 0};
+
+void wheel_add(struct el *e)
+{
+    time_t t = e->expires;
+    struct el **list = &expiring;
+    int level;
+
+    if (!wheel_now) {
+        wheel_now = time(NULL);
+    }
+    if (t > wheel_now) {
+        if (t - wheel_now >= (time_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) {
+            /* parked in the last slot, it moves down from there */
+            t = wheel_now + ((time_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        }
+        for (level=0; level < WHEEL_LEVELS - 1 &&
+                 t - wheel_now >= (time_t)1 << (WHEEL_BITS * (level + 1)); level++);
+        list = &wheel[level][(t >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    }
+    e->wheel_list = list;
+    DL_APPEND(*list, e);
+}
+
+void wheel_del(struct el *e)
+{
+    if (e->wheel_list) {
+        DL_DELETE(*e->wheel_list, e);
+        e->wheel_list = NULL;
+    }
+}
+
+/*
+ *  Sets when e expires, 0 for never, and files it in the wheel. Call
+ *  with ns->lock held, so a flush sees the expiry with the change that
+ *  dirtied the namespace.
+ */
+void el_set_expiry(struct el *e, time_t expires)
+{
+    e->expires = expires;
+    if (expires && (!e->ns->next_expiry || expires < e->ns->next_expiry)) {
+        e->ns->next_expiry = expires;
+    }
+    wheel_del(e);
+    if (expires) {
+        wheel_add(e);
+    }
+}
+
+/*
+ *  Removes an expired element found by the wheel or by a request.
+ */
+void expire_el(struct el *e)
+{
+    struct namespace *ns = e->ns;
+
+    lock_namespace(ns);
+    unlink_el(ns, e);
+    hash_charge(ns);
+    compact_check(ns);
+    bump_version(ns);
+    if (ns->dirty++ == 0) {
+        count_add(C_DIRTIED, 1);
+    }
+    pthread_mutex_unlock(&ns->lock);
+    free_el(e);
+    count_add(C_EXPIRED, 1);
+}
+
+/*
+ *  The wheel only gets to an element in the tick after it expires, or
+ *  later with a backlog in expiring, and the version only changes then.
+ *  Searches filter expired elements, but a cached response or an ETag
+ *  from before would still be served, so once the namespace's earliest
+ *  expiry passes its version is bumped and the next one looked up.
+ */
+void expire_check(struct namespace *ns, time_t now)
+{
+    struct el *e;
+    time_t next = 0;
+
+    if (!ns->next_expiry || ns->next_expiry > now) {
+        return;
+    }
+    lock_namespace(ns);
+    for (e=first_el(ns); e != NULL; e=next_el(ns, e)) {
+        if (e->expires > now && (!next || e->expires < next)) {
+            next = e->expires;
+        }
+    }
+    ns->next_expiry = next;
+    bump_version(ns);
+    pthread_mutex_unlock(&ns->lock);
+}
+
+/*
+ *  For scans holding ns->lock, which expire_el() needs: moves e from
+ *  the wheel to the caller's list, to expire once the lock is dropped.
+ */
+void expire_later(struct el **list, struct el *e)
+{
+    wheel_del(e);
+    DL_APPEND(*list, e);
+}
+
+void expire_list(struct el **list)
+{
+    struct el *e, *tmp;
+
+    DL_FOREACH_SAFE(*list, e, tmp) {
+        DL_DELETE(*list, e);
+        expire_el(e);
+    }
+}
+
+void wheel_cascade(struct el **list)
+{
+    struct el *e, *tmp;
+
+    DL_FOREACH_SAFE(*list, e, tmp) {
+        DL_DELETE(*list, e);
+        wheel_add(e);
+    }
+}
+
+void expire_tick(int fd, short event, void *arg)
+{
+    static struct timeval now_tv = {0, 0};
+    time_t now = time(NULL);
+    int level, n;
+
+    if (!wheel_now) {
+        wheel_now = now;
+    }
+    while (wheel_now < now) {
+        wheel_now++;
+        for (level=1; level < WHEEL_LEVELS &&
+                 ((wheel_now >> (WHEEL_BITS * (level - 1))) & (WHEEL_SLOTS - 1)) == 0; level++) {
+            wheel_cascade(&wheel[level][(wheel_now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)]);
+        }
+        wheel_cascade(&wheel[0][wheel_now & (WHEEL_SLOTS - 1)]);
+    }
+    /*
+     *  A burst of expiries is spread over several passes of the event
+     *  loop so requests get in between.
+     */
+    for (n=0; expiring && n < EXPIRE_BATCH; n++) {
+        expire_el(expiring);
+    }
+    evtimer_set(&expire_timer, expire_tick, NULL);
+    evtimer_add(&expire_timer, expiring ? &now_tv : &expire_tv);
+}
+
+/*
+ *  Elements cut off by a nuke leave every index and the accounting
+ *  straight away, but their memory is given back REAP_BATCH at a time
+ *  from the event loop, so forgetting a large prefix doesn't hold up
+ *  the requests queued behind it.
+ */
+#define REAP_BATCH 1024
+
+struct el *reaping = NULL;
+struct event reap_timer;
+int reap_armed = 0;
+
+void reap_tick(int fd, short event, void *arg)
+{
+    static struct timeval now_tv = {0, 0};
+    struct el *e;
+    int n;
+
+    for (n=0; reaping && n < REAP_BATCH; n++) {
+        e = reaping;
+        DL_DELETE(reaping, e);
+        release_el(e);
+    }
+    reap_armed = reaping != NULL;
+    if (reap_armed) {
+        evtimer_set(&reap_timer, reap_tick, NULL);
+        evtimer_add(&reap_timer, &now_tv);
+    }
+}
+
+void reap_el(struct namespace *ns, struct el *e)
+{
+    unlink_el(ns, e);
+    uncharge_el(e);
+    DL_APPEND(reaping, e);
+}
+
+/*
+ *  Reaps everything below a subtree already cut from the trie.
+ */
+int trie_reap(struct namespace *ns, struct trie *t)
+{
+    struct trie *node;
+    struct el *e, *enext;
+    int n = 0;
+
+    for (node=t; node; node=trie_next(node, t)) {
+        for (e=node->elems; e; e=enext) {
+            enext = e->trie_next;
+            e->trie = NULL;
+            reap_el(ns, e);
+            n++;
+        }
+        node->elems = NULL;
+    }
+    trie_free(ns, t);
+    return n;
+}
+
+void trie_collect(struct trie *t, char *id, struct el ***elems, int *n, int *size)
+{
+    struct trie *node;
+    struct el *e;
+
+    for (node=t; node; node=trie_next(node, t)) {
+        for (e=node->elems; e; e=e->trie_next) {
+            if (!id || strcmp(e->ckey->id, id) == 0) {
+                if (*n == *size) {
+                    *size = *size ? *size * 2 : 16;
+                    *elems = realloc(*elems, *size * sizeof(**elems));
+                }
+                (*elems)[(*n)++] = e;
+            }
+        }
+    }
+}
+
+/*
+ *  Reaps every element under t, or with an id only those with that id.
+ *  Without one the whole subtree is cut off in one go. Returns how
+ *  many elements went.
+ */
+int trie_nuke(struct namespace *ns, struct trie *t, char *id)
+{
+    struct trie **c, *parent = t->parent;
+    struct el **elems = NULL;
+    int i, n = 0, size = 0;
+
+    if (id) {
+        trie_collect(t, id, &elems, &n, &size);
+        for (i=0; i < n; i++) {
+            reap_el(ns, elems[i]);
+        }
+        safe_free(elems);
+    } else if (t == ns->trie) {
+        ns->trie = trie_new(ns, NULL, 0);
+        n = trie_reap(ns, t);
+    } else {
+        for (c=&parent->child; *c != t; c=&(*c)->sibling);
+        *c = t->sibling;
+        n = trie_reap(ns, t);
+        trie_prune(ns, parent);
+    }
+    if (reaping && !reap_armed) {
+        reap_armed = 1;
+        reap_tick(0, 0, NULL);
+    }
+    return n;
+}
+
+char *utf8_tolower(char *s, char *locale)
+{
+    UChar *buf = NULL;
+    char *buf2 = NULL;
+    UErrorCode err = U_ZERO_ERROR;
+    int32_t len = 0, len2 = 0;
+
+    u_strFromUTF8(NULL, 0, &len, s, -1, &err);
+    buf = malloc(sizeof(UChar) * len+1);
+    memset(buf, 0, sizeof(UChar) * len+1);
+    err = U_ZERO_ERROR;
+    u_strFromUTF8(buf, len+1, NULL, s, -1, &err);
+    if (U_FAILURE(err)) {
+        log_msg(LOG_WARN, "u_strFromUTF8 failed: %s: %s", s, u_errorName(err));
+        free(buf);
+        return NULL;
+    }
+
+    err = U_ZERO_ERROR;
+    len2 = u_strToLower(NULL, 0, (UChar *)buf, -1, locale, &err);
+    if (len2 > len) {
+        buf = realloc(buf, sizeof(UChar *) * len2+1);
+        memset(buf, 0, sizeof(UChar) * len2+1);
+    }
+    err = U_ZERO_ERROR;
+    u_strToLower(buf, len2+1, (UChar *)buf, -1, locale, &err);
+    if (U_FAILURE(err)) {
+        log_msg(LOG_WARN, "u_strToLower failed: %s: %s", s, u_errorName(err));
+        free(buf);
+        return NULL;
+    }
+
+    err = U_ZERO_ERROR;
+    u_strToUTF8(NULL, 0, &len, buf, -1, &err);
+    buf2 = malloc(sizeof(char *) * len+1);
+    memset(buf2, 0, sizeof(char *) * len+1);
+    err = U_ZERO_ERROR;
+    u_strToUTF8(buf2, len+1, &len, (UChar *)buf, -1, &err);
+    if (U_FAILURE(err)) {
+        log_msg(LOG_WARN, "u_strToUTF8 failed: %s: %s", s, u_errorName(err));
+        free(buf);
+        free(buf2);
+        return NULL;
+    }
+    free(buf);
+    return buf2;
+}
+
+/*
+ *  -n fold: NFKC, lowercase, then drop the nonspacing marks NFD splits
+ *  off and recompose, so "ＣＡＦÉ" and "cafe" are the same key.
+ */
+UChar *utf16_normalize(const UNormalizer2 *norm, UChar *s, int32_t *len)
+{
+    UErrorCode err = U_ZERO_ERROR;
+    UChar *out;
+    int32_t olen;
+
+    if (!norm) {
+        log_msg(LOG_WARN, "no normalizer");
+        free(s);
+        return NULL;
+    }
+    olen = unorm2_normalize(norm, s, *len, NULL, 0, &err);
+    out = malloc(sizeof(UChar) * (olen + 1));
+    err = U_ZERO_ERROR;
+    unorm2_normalize(norm, s, *len, out, olen + 1, &err);
+    free(s);
+    if (U_FAILURE(err)) {
+        log_msg(LOG_WARN, "unorm2_normalize failed: %s", u_errorName(err));
+        free(out);
+        return NULL;
+    }
+    *len = olen;
+    return out;
+}
+
+char *utf8_fold(char *s, char *locale)
+{
+    UErrorCode err = U_ZERO_ERROR;
+    UChar *buf, *lower;
+    char *out;
+    int32_t len = 0, i, j;
+    UChar32 c;
+
+    u_strFromUTF8(NULL, 0, &len, s, -1, &err);
+    buf = malloc(sizeof(UChar) * (len + 1));
+    err = U_ZERO_ERROR;
+    u_strFromUTF8(buf, len + 1, NULL, s, -1, &err);
+    if (U_FAILURE(err)) {
+        log_msg(LOG_WARN, "u_strFromUTF8 failed: %s: %s", s, u_errorName(err));
+        free(buf);
+        return NULL;
+    }
+    if (!(buf = utf16_normalize(unorm2_getNFKCInstance(&err), buf, &len))) {
+        return NULL;
+    }
+
+    err = U_ZERO_ERROR;
+    i = u_strToLower(NULL, 0, buf, len, locale, &err);
+    lower = malloc(sizeof(UChar) * (i + 1));
+    err = U_ZERO_ERROR;
+    len = u_strToLower(lower, i + 1, buf, len, locale, &err);
+    free(buf);
+    if (U_FAILURE(err)) {
+        log_msg(LOG_WARN, "u_strToLower failed: %s: %s", s, u_errorName(err));
+        free(lower);
+        return NULL;
+    }
+
+    if (!(buf = utf16_normalize(unorm2_getNFDInstance(&err), lower, &len))) {
+        return NULL;
+    }
+    for (i=0, j=0; i < len; ) {
+        U16_NEXT(buf, i, len, c);
+        if (u_charType(c) != U_NON_SPACING_MARK) {
+            U16_APPEND_UNSAFE(buf, j, c);
+        }
+    }
+    len = j;
+    if (!(buf = utf16_normalize(unorm2_getNFCInstance(&err), buf, &len))) {
+        return NULL;
+    }
+
+    err = U_ZERO_ERROR;
+    u_strToUTF8(NULL, 0, &i, buf, len, &err);
+    out = malloc(i + 1);
+    err = U_ZERO_ERROR;
+    u_strToUTF8(out, i + 1, NULL, buf, len, &err);
+    free(buf);
+    if (U_FAILURE(err)) {
+        log_msg(LOG_WARN, "u_strToUTF8 failed: %s: %s", s, u_errorName(err));
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+/*
+ *  Lowercasing only depends on the locale for Turkish, Azeri and
+ *  Lithuanian; everywhere else the tables below give what ICU would.
+ */
+int locale_plain(char *locale)
+{
+    if (!locale) {
+        locale = (char *)uloc_getDefault();
+    }
+    return !((strncmp(locale, "tr", 2) == 0 || strncmp(locale, "az", 2) == 0 ||
+              strncmp(locale, "lt", 2) == 0) && (locale[2] == '\0' || locale[2] == '_' || locale[2] == '-'));
+}
+
+/*
+ *  Normalizes s without ICU when it can: ASCII only needs lowercasing,
+ *  and with -n fold the code points in fold.h are looked up, which
+ *  covers Latin, Greek, Cyrillic, kana, CJK, Hangul and the fullwidth
+ *  forms. Returns NULL for anything else, which then goes the ICU way
+ *  as a whole.
+ */
+char *table_fold(char *s, int len)
+{
+    const struct fold_range *r;
+    char *out = malloc(len * 2 + 1);
+    int i = 0, n = 0;
+    UChar32 c;
+    uint16_t m;
+
+    while (i < len) {
+        if ((unsigned char)s[i] < 0x80) {
+            out[n++] = s[i] >= 'A' && s[i] <= 'Z' ? s[i] + 32 : s[i];
+            i++;
+            continue;
+        }
+        if (normalize != NORM_FOLD) {
+            free(out);
+            return NULL;
+        }
+        U8_NEXT(s, i, len, c);
+        for (r=fold_ranges; r->hi && (c < r->lo || c >= r->hi); r++);
+        if (!r->hi || (m = r->map ? r->map[c - r->lo] : c) == FOLD_ICU) {
+            free(out);
+            return NULL;
+        }
+        if (m) {
+            U8_APPEND_UNSAFE(out, n, m);
+        }
+    }
+    out[n] = '\0';
+    return out;
+}
+
+composite_key *make_key(char *locale, char *key, char *id)
+{
+    composite_key *ckey = NULL;
+    char *normalized_key;
+    int klen, ilen;
+    uint64_t start = now_usec();
+    
+    if (!key) {
+        key = EMPTY_STRING;
+    }
+    if (!id) {
+        id = EMPTY_STRING;
+    }
+    if (!locale_plain(locale) || !(normalized_key = table_fold(key, strlen(key)))) {
+        normalized_key = normalize == NORM_FOLD ? utf8_fold(key, locale) : utf8_tolower(key, locale);
+    }
+    if (normalized_key) {
+        klen = strlen(normalized_key);
+        ilen = strlen(id);
+        ckey = malloc(sizeof(*ckey) + klen + ilen + 1);
+        ckey->key = ckey->data;
+        strncpy(ckey->key, normalized_key, klen+1);
+        ckey->id = ckey->data + klen + 1;
+        strncpy(ckey->id, id, ilen+1);
+        ckey->len[0] = klen;
+        ckey->len[1] = ilen;
+        safe_free(normalized_key);
+    }
+    stat_since(STAT_NORMALIZE, start);
+    return ckey;
+}
+
+void print_el(struct el *e)
+{
+    log_msg(LOG_DEBUG, "%s:%s data %s when %ld count %d", e->ckey->key,
+            e->ckey->id, e->data, e->when, e->count);
+}
+
+/*
+ *  Adds or replaces an element; expires is when it goes, 0 for never
+ *  or -1 for the namespace's ttl from now. mark counts it as a hit and
+ *  dirties the namespace, which loading from disk doesn't.
+ */
+struct el *put_el(char *namespace, char *locale, char *key, char *id, char *data, time_t when,
+                  time_t expires, int mark)
+{
+    struct namespace *ns;
+    struct el *e = NULL, *victim;
+    composite_key *ckey;
+    int new, limit, evicted = 0;
+
+    ckey = make_key(locale, key, id);
+    if (!ckey) {
+        return NULL;
     }
     ns = create_namespace(namespace, &new);
-    pthread_mutex_lock(&ns->lock);
-    if (HASH_COUNT(ns->elems) > max_elems) {
+    if (new) {
+        bloom_remember(namespace);
+    }
+    lock_namespace(ns);
+    e = find_el(ns, ckey);
+    if (e && el_expired(e, time(NULL))) {
+        /* start over rather than count hits from before it expired */
+        pthread_mutex_unlock(&ns->lock);
+        expire_el(e);
+        lock_namespace(ns);
+        e = NULL;
+    }
+    if (e) {
+        unlink_el(ns, e);
+        safe_free(ckey);
+        el_charge(e, -1);
+    } else {
+        e = malloc(sizeof(*e));
+        memset(e, 0, sizeof(*e));
+        e->ckey = ckey;
+        e->ns = ns;
+        count_add(C_ELEMS, 1);
+    }
+    safe_free(e->data);
+    e->data = safe_strdup(data);
+    safe_free(e->frag);
+    e->frag = NULL;
+    e->when = when;
+    if (mark) {
+        if (e->count++) {
+            e->frecency = frecency_add(e->frecency, when / FRECENCY_HALF_LIFE);
+        } else {
+            e->frecency = when / FRECENCY_HALF_LIFE;
+        }
+    } else if (!e->count) {
+        e->frecency = when / FRECENCY_HALF_LIFE;
+    }
+    /*
+     *  Make room before e goes in, so the policy never picks e itself.
+     *  Indexes are built by searches, so they don't count against the
+     *  quota, or a read could evict data.
+     */
+    limit = ns->max_elems ? ns->max_elems : max_elems;
+    while (ns->heap_len && (count_els(ns) >= limit ||
+                            (ns_quota && ns->bytes - ns->mem[MEM_INDEX] + el_size(e) > ns_quota))) {
+        victim = ns->heap[0];
+        unlink_el(ns, victim);
+        free_el(victim);
+        evicted = 1;
+    }
+    el_charge(e, 1);
+    HASH_ADD_KEYPTR(hh, ns->elems, e->ckey->data, KEY_LEN(e->ckey), e);
+    if (ns->compact_elems && !ns->compact_next) {
+        /* the rest were deleted, e is still to move */
+        ns->compact_next = e;
+    }
+    heap_insert(ns, e);
+    if (ns->rank_built) {
+        rank_insert(ns, e);
+    }
+    if (ns->trie) {
+        trie_insert(ns, e);
+    }
+    if (ns->words) {
+        words_insert(ns, e);
+    }
+    if (ns->gram_elems) {
+        grams_insert(ns, e);
+    }
+    if (expires < 0) {
+        expires = ns->ttl ? time(NULL) + ns->ttl : 0;
+    }
+    el_set_expiry(e, expires);
+    if (evicted) {
+        /* a full namespace churns gids as fast as it takes puts */
+        compact_check(ns);
+    }
+    hash_charge(ns);
+    bump_version(ns);
+    if (mark && ns->dirty++ == 0) {
+        count_add(C_DIRTIED, 1);
+    }
+    pthread_mutex_unlock(&ns->lock);
+
+    return e;
+}
+
+/*
+ *  Per namespace settings from /config live next to the data file as
+ *  ".<name>.conf", one key=value per line.
+ */
+void load_config(struct namespace *ns)
+{
+    UT_string *conf;
+    FILE *f;
+    char key[32], val[32];
+    int i;
+
+    utstring_new(conf);
+    namespace_file(conf, ns->name, ".conf");
+    f = fopen(utstring_body(conf), "r");
+    utstring_free(conf);
+    if (!f) {
+        return;
+    }
+    while (fscanf(f, " %31[^=]=%31s", key, val) == 2) {
+        if (strcmp(key, "max_elems") == 0) {
+            ns->max_elems = atoi(val);
+        } else if (strcmp(key, "policy") == 0) {
+            if ((i = find_policy(val)) != -1) {
+                ns->policy = i;
+            }
+        } else if (strcmp(key, "ttl") == 0) {
+            ns->ttl = atoi(val);
+        } else if (strcmp(key, "infix") == 0) {
+            ns->infix = atoi(val) != 0;
+        }
+    }
+    fclose(f);
+    ns->configured = 1;
+}
+
+void save_config(struct namespace *ns)
+{
+    UT_string *tmp, *conf;
+    FILE *f;
+
+    utstring_new(tmp);
+    utstring_new(conf);
+    namespace_file(conf, ns->name, ".conf");
+    namespace_file(tmp, ns->name, ".conf.tmp");
+    f = fopen(utstring_body(tmp), "w");
+    if (f) {
+        fprintf(f, "max_elems=%d\npolicy=%s\nttl=%d\ninfix=%d\n", ns->max_elems, policy_names[ns->policy],
+                ns->ttl, ns->infix);
+        if (fclose(f) == 0) {
+            rename(utstring_body(tmp), utstring_body(conf));
+        }
+    } else {
+        log_msg(LOG_ERROR, "open failed: %s: %s", utstring_body(tmp), strerror(errno));
+    }
+    utstring_free(tmp);
+    utstring_free(conf);
+}
+
+/*
+ *  A data file is DB_MAGIC then one record per element: a struct hdr,
+ *  in network order, followed by the key, id and data. Files from
+ *  before expiry have no magic and a header without expires.
+ */
+#define DB_MAGIC "AC2\n"
+
+struct hdr {
+    uint32_t klen;
+    uint32_t ilen;
+    uint32_t dlen;
+    uint32_t when;
+    uint32_t count;
+    uint32_t expires;
+};
+
+void load_namespace(char *namespace)
+{
+    struct namespace *ns;
+    struct el *e;
+    UT_string *ustr;
+    int fd, n, klen, dlen, ilen, hlen = sizeof(struct hdr);
+    char *key = NULL, *id = NULL, *data = NULL, magic[4];
+    struct hdr hdr;
+    time_t now = time(NULL);
+    uint64_t start;
+    
+    if (!db_dir || !namespace) {
+        return;
+    }
+    
+    start = now_usec();
+    utstring_new(ustr);
+    namespace_path(ustr, namespace);
+    HASH_FIND_STR(spaces, namespace, ns);
+    if (ns) {
+        load_config(ns);
+    }
+    fd = open(utstring_body(ustr), O_RDONLY);
+    if (fd == -1) {
+        log_msg(LOG_DEBUG, "open() failed: %s: %s", utstring_body(ustr), strerror(errno));
+        utstring_free(ustr);
+        return;
+    }
+    if (read(fd, magic, sizeof(magic)) != sizeof(magic) || memcmp(magic, DB_MAGIC, sizeof(magic)) != 0) {
+        hlen = offsetof(struct hdr, expires);
+        lseek(fd, 0, SEEK_SET);
+    }
+    hdr.expires = 0;
+    n = read(fd, &hdr, hlen);
+    log_msg(LOG_INFO, "loading: %s from %s", namespace, utstring_body(ustr));
+    loading = 1;
+    while (n == hlen) {
+        klen = ntohl(hdr.klen);
+        ilen = ntohl(hdr.ilen);
+        dlen = ntohl(hdr.dlen);
+        key = realloc(key, klen);
+        id = realloc(id, ilen);
+        data = realloc(data, dlen);
+        n = read(fd, key, klen);
+        n = read(fd, id, ilen);
+        n = read(fd, data, dlen);
+        if (hdr.expires && ntohl(hdr.expires) <= now) {
+            n = read(fd, &hdr, hlen);
+            continue;
+        }
+        e = put_el(namespace, NULL, key, id, dlen ? data : NULL, ntohl(hdr.when), ntohl(hdr.expires), 0);
+        e->count = ntohl(hdr.count);
+        /*
+         *  Only the last hit is on disk, so count every hit as that
+         *  recent; frecency_add() would agree if they all were.
+         */
+        rescore_el(e->ns, e, e->when / FRECENCY_HALF_LIFE + log2(e->count > 1 ? e->count : 1));
+        n = read(fd, &hdr, hlen);
+    }
+    close(fd);
+    safe_free(key);
+    safe_free(id);
+    safe_free(data);
+    utstring_free(ustr);
+    loading = 0;
+    stat_since(STAT_LOAD, start);
+}
+
+/*
+ *  Returns the number of bytes written.
+ */
+size_t save_namespace(struct namespace *ns)
+{
+    struct el *e;
+    UT_string *path1, *path2;
+    int fd, ok, n, dirty;
+    size_t bytes = 0;
+    struct hdr hdr;
+    
+    if (!db_dir || !ns) {
+        return 0;
+    }
+    log_msg(LOG_INFO, "save_namespace %s %d", ns->name, ns->dirty);
+    
+    utstring_new(path1);
+    namespace_file(path1, ns->name, ".tmp");
+    fd = open(utstring_body(path1), O_CREAT|O_TRUNC|O_RDWR, 0660);
+    if (fd == -1) {
+        log_msg(LOG_ERROR, "open failed: %s: %s", utstring_body(path1), strerror(errno));
+        utstring_free(path1);
+        return 0;
+    }
+    
+    lock_namespace(ns);
+    dirty = ns->dirty;
+    bytes += write(fd, DB_MAGIC, 4);
+    for (ok=1, e=first_el(ns); e != NULL; e=next_el(ns, e)) {
+        hdr.klen = htonl(e->ckey->len[0]+1);
+        hdr.ilen = htonl(e->ckey->len[1]+1);
+        if (e->data != NULL) {
+            hdr.dlen = htonl(strlen(e->data)+1);
+        } else {
+            hdr.dlen = 0;
+        }        
+        hdr.when = htonl(e->when);
+        hdr.count = htonl(e->count);
+        hdr.expires = htonl(e->expires);
+        n = write(fd, &hdr, sizeof(hdr));
+        if (n == -1) {
+            log_msg(LOG_ERROR, "write failed: %s: %s", utstring_body(path1), strerror(errno));
+            ok = 0;
+            break;
+        }
+        bytes += n;
+        bytes += write(fd, e->ckey->key, e->ckey->len[0]+1);
+        bytes += write(fd, e->ckey->id, e->ckey->len[1]+1);
+        if (e->data != NULL) {
+            bytes += write(fd, e->data, strlen(e->data)+1);
+        }
+    }
+    pthread_mutex_unlock(&ns->lock);
+
+    utstring_new(path2);
+    namespace_path(path2, ns->name);
+    if (ok) {
+        rename(utstring_body(path1), utstring_body(path2));
+        if (ns->configured) {
+            save_config(ns);
+        }
         /*
-         *  This is tricky. UT_hash keeps two sort orders.
-         *  This deletes from the head ( oldest insert ).
+         *  Puts that landed while the file was written stay dirty.
          */
-        e = ns->elems;
+        lock_namespace(ns);
+        ns->dirty -= dirty;
+        if (ns->dirty == 0) {
+            count_add(C_FLUSHED, 1);
+        }
+        pthread_mutex_unlock(&ns->lock);
+        count_add(C_FLUSH_BYTES, bytes);
+    }
+    close(fd);
+    utstring_free(path1);
+    utstring_free(path2);
+    return bytes;
+}
+
+void save_namespaces()
+{
+    struct namespace *ns, *results = NULL;
+    uint64_t start = now_usec();
+    size_t bytes = 0;
+    int i;
+    
+    /*
+     *  Pinned namespaces are never evicted, so they stay valid after
+     *  the master lock is dropped.
+     */
+    lock_master();
+    HASH_SELECT(dh, results, hh, spaces, dirty_match);
+    for (ns=results; ns != NULL; ns=ns->dh.next) {
+        ns->pinned = 1;
+    }
+    pthread_mutex_unlock(&master_lock);
+    for (ns=results, i=0; ns != NULL; ns=ns->dh.next, i++) {
+        bytes += save_namespace(ns);
+    }
+    lock_master();
+    for (ns=results; ns != NULL; ns=ns->dh.next) {
+        ns->pinned = 0;
+    }
+    HASH_CLEAR(dh, results);
+    pthread_mutex_unlock(&master_lock);
+    if (i) {
+        stat_since(STAT_FLUSH, start);
+        last_flush_bytes = bytes;
+    }
+}
+
+void *backup_thread(void *ctx)
+{
+    pthread_mutex_lock(&master_lock);
+    while (is_running) {
+        pthread_cond_wait(&backup_cond, &master_lock);
+        pthread_mutex_unlock(&master_lock);
+        save_namespaces();
+        if (trim_wanted) {
+            /* free pages left by compaction, off the event thread */
+            trim_wanted = 0;
+#ifdef __GLIBC__
+            malloc_trim(0);
+#endif
+        }
+    }
+    return NULL;
+}
+
+void backup(int timer_fd, short event, void *arg)
+{
+    evtimer_set(&backup_timer, backup, NULL);
+    pthread_mutex_lock(&master_lock);
+    pthread_cond_signal(&backup_cond);
+    pthread_mutex_unlock(&master_lock);
+    evtimer_add(&backup_timer, &backup_tv);
+}
+
+/*
+ *  Drops a clean, unpinned namespace from memory; the next request for
+ *  it loads it from disk again. Returns 0 if it can't be evicted yet.
+ */
+int evict_namespace(struct namespace *ns)
+{
+    struct el *e, *tmp;
+
+    lock_master();
+    if (ns->dirty || ns->pinned) {
+        pthread_mutex_unlock(&master_lock);
+        return 0;
+    }
+    HASH_DEL(spaces, ns);
+    pthread_mutex_unlock(&master_lock);
+    DL_DELETE(spaces_lru, ns);
+    if (ns->compact_queued) {
+        HASH_DELETE(ch, compacting, ns);
+    }
+    log_msg(LOG_DEBUG, "evicting %s %lld bytes", ns->name, (long long)ns->bytes);
+    HASH_ITER(hh, ns->elems, e, tmp) {
         HASH_DEL(ns->elems, e);
         free_el(e);
     }
-    HASH_FIND(hh, ns->elems, ckey->data, KEY_LEN(ckey), e);
-    if (e) {
-        HASH_DEL(ns->elems, e);
-        safe_free(ckey);
-    } else {
-        e = malloc(sizeof(*e));
-        memset(e, 0, sizeof(*e));
-        e->ckey = ckey;
+    HASH_ITER(hh, ns->compact_elems, e, tmp) {
+        HASH_DEL(ns->compact_elems, e);
+        free_el(e);
+    }
+    hash_charge(ns);
+    if (ns->trie) {
+        trie_free(ns, ns->trie);
+    }
+    if (ns->words) {
+        trie_free(ns, ns->words);
+    }
+    if (ns->gram_elems) {
+        grams_free(ns);
+    }
+    free(ns->heap);
+    ns_charge(ns, MEM_INDEX, -ns->mem[MEM_INDEX]);
+    ns_charge(ns, MEM_NAMESPACE, -(int64_t)(sizeof(*ns) + strlen(ns->name) + 1));
+    count_add(C_NAMESPACES, -1);
+    count_add(C_NS_EVICTED, 1);
+    pthread_mutex_destroy(&ns->lock);
+    free(ns->name);
+    free(ns);
+    return 1;
+}
+
+/*
+ *  Evicts least recently used namespaces until under the -m budget.
+ *  The most recent one is always kept. Dirty ones can't go until they
+ *  are flushed, so the backup thread is woken early for them, and only
+ *  a bounded number are stepped over per call.
+ */
+void enforce_budget()
+{
+    struct namespace *ns, *prev;
+    int skipped = 0;
+
+    if (!mem_budget || !spaces_lru) {
+        return;
+    }
+    for (ns=spaces_lru->prev; ns != spaces_lru && ns_bytes > mem_budget && skipped < 64; ns=prev) {
+        prev = ns->prev;
+        if (!evict_namespace(ns)) {
+            skipped++;
+        }
+    }
+    if (skipped) {
+        pthread_mutex_lock(&master_lock);
+        pthread_cond_signal(&backup_cond);
+        pthread_mutex_unlock(&master_lock);
+    }
+}
+
+/*
+ *  True if namespace is loaded or may be on disk.
+ */
+int namespace_exists(char *namespace)
+{
+    struct namespace *ns;
+
+    HASH_FIND_STR(spaces, namespace, ns);
+    return ns || (blooms && bloom_check(namespace));
+}
+
+/*
+ *  For changes to a namespace that may not be loaded: loads it if it
+ *  was ever saved, but never creates an empty one.
+ */
+struct namespace *find_namespace(char *namespace)
+{
+    struct namespace *ns = get_namespace(namespace);
+    UT_string *path;
+
+    if (!ns && db_dir && bloom_check(namespace)) {
+        utstring_new(path);
+        namespace_path(path, namespace);
+        if (access(utstring_body(path), F_OK) == 0) {
+            ns = create_namespace(namespace, NULL);
+        }
+        utstring_free(path);
+    }
+    return ns;
+}
+
+void put_cb(struct evhttp_request *req, void *arg)
+{
+    struct evbuffer *buf = evbuffer_new();
+    struct evkeyvalq args;
+    uint64_t start = now_usec();
+    struct el *e;
+    char *namespace, *key, *id, *data, *ts, *locale, *sttl;
+    time_t when = time(NULL);
+    struct trace trace;
+    int ttl;
+
+    evhttp_parse_query(req->uri, &args);
+    namespace = (char *)evhttp_find_header(&args, "namespace");
+    key =       (char *)evhttp_find_header(&args, "key");
+    data =      (char *)evhttp_find_header(&args, "data");
+    id =        (char *)evhttp_find_header(&args, "id");
+    locale =    (char *)evhttp_find_header(&args, "locale");
+    ts =        (char *)evhttp_find_header(&args, "ts");
+    sttl =      (char *)evhttp_find_header(&args, "ttl");
+    trace_begin(&trace, namespace, key);
+    if (ts) {
+        when = (time_t)strtol(ts, NULL, 10);
+    }
+
+    if (sttl && atoi(sttl) < 0) {
+        evhttp_send_reply(req, HTTP_BADREQUEST, "BAD_ARG", buf);
+    } else if (namespace && key && ns_quota && el_estimate(key, id, data) > ns_quota) {
+        evhttp_send_reply(req, HTTP_ENTITYTOOLARGE, "QUOTA_EXCEEDED", buf);
+    } else if (namespace && key) {
+        /* counted from now, ts only says when it was used */
+        ttl = sttl ? atoi(sttl) : -1;
+        e = put_el(namespace, locale, key, id, data, when, ttl > 0 ? time(NULL) + ttl : ttl, 1);
+        if (e) {
+            evhttp_send_reply(req, HTTP_OK, "OK", buf);
+        } else {
+            evhttp_send_reply(req, HTTP_INTERNAL, "ERR", buf);
+        }
+    } else {
+        evhttp_send_reply(req, HTTP_BADREQUEST, "MISSING_REQ_ARG", buf);
+    }
+
+    evhttp_clear_headers(&args);
+    evbuffer_free(buf);
+    log_access(req, STAT_PUT, -1, start);
+    enforce_budget();
+}
+
+void del_cb(struct evhttp_request *req, void *arg)
+{
+    struct evbuffer *buf = evbuffer_new();
+    struct evkeyvalq args;
+    uint64_t start = now_usec();
+    struct namespace *ns;
+    composite_key *ckey;
+    struct el *e;
+    char *namespace, *key, *id, *locale;
+    
+    evhttp_parse_query(req->uri, &args);
+    namespace = (char *)evhttp_find_header(&args, "namespace");
+    key =       (char *)evhttp_find_header(&args, "key");
+    id =        (char *)evhttp_find_header(&args, "id");
+    locale =    (char *)evhttp_find_header(&args, "locale");
+    
+    if (namespace && key) {
+        ns = find_namespace(namespace);
+        ckey = make_key(locale, key, id);
+        if (ns && ckey) {
+            lock_namespace(ns);
+            e = find_el(ns, ckey);
+            if (e) {
+                unlink_el(ns, e);
+                hash_charge(ns);
+                compact_check(ns);
+                bump_version(ns);
+                if (ns->dirty++ == 0) {
+                    count_add(C_DIRTIED, 1);
+                }
+            }
+            pthread_mutex_unlock(&ns->lock);
+            free_el(e);
+        }        
+        safe_free(ckey);
+        evhttp_send_reply(req, HTTP_OK, "OK", buf);
+    } else {
+        evhttp_send_reply(req, HTTP_BADREQUEST, "MISSING_REQ_ARG", buf);
+    }
+    
+    evhttp_clear_headers(&args);
+    evbuffer_free(buf);
+    log_access(req, STAT_DEL, -1, start);
+    enforce_budget();
+}
+
+void nuke_cb(struct evhttp_request *req, void *arg)
+{
+    struct evbuffer *buf = evbuffer_new();
+    struct evkeyvalq args;
+    uint64_t start = now_usec();
+    struct namespace *ns;
+    composite_key *ckey;
+    char *namespace, *key, *id, *locale;
+    struct trie *t;
+    
+    evhttp_parse_query(req->uri, &args);
+    namespace = (char *)evhttp_find_header(&args, "namespace");
+    key =       (char *)evhttp_find_header(&args, "key");
+    id =        (char *)evhttp_find_header(&args, "id");
+    locale =    (char *)evhttp_find_header(&args, "locale");
+    
+    if (namespace) {
+        ns = find_namespace(namespace);
+        ckey = make_key(locale, key, id);
+        if (ns && ckey) {
+            lock_namespace(ns);
+            if (!ns->trie) {
+                trie_build(ns);
+            }
+            t = trie_find(ns->trie, ckey->key, ckey->len[0]);
+            if (t && trie_nuke(ns, t, id ? ckey->id : NULL)) {
+                if (ns->dirty++ == 0) {
+                    count_add(C_DIRTIED, 1);
+                }
+                hash_charge(ns);
+                compact_check(ns);
+                bump_version(ns);
+            }
+            pthread_mutex_unlock(&ns->lock);
+        }        
+        safe_free(ckey);
+        evhttp_send_reply(req, HTTP_OK, "OK", buf);
+    } else {
+        evhttp_send_reply(req, HTTP_BADREQUEST, "MISSING_REQ_ARG", buf);
+    }
+    
+    evhttp_clear_headers(&args);
+    evbuffer_free(buf);
+    log_access(req, STAT_NUKE, -1, start);
+    enforce_budget();
+}
+
+/*
+ *  Minimal JSON writer. Output matches json-c's spaced format byte for
+ *  byte, so clients can't tell the difference, but nothing is allocated:
+ *  runs of plain bytes go straight into the evbuffer.
+ */
+void json_add_string(struct evbuffer *buf, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *run;
+    char esc[7] = "\\u00";
+    unsigned char c;
+
+    evbuffer_add(buf, "\"", 1);
+    for (run = s; (c = *s) != '\0'; s++) {
+        if (c >= ' ' && c != '"' && c != '\\' && c != '/') {
+            continue;
+        }
+        if (s > run) {
+            evbuffer_add(buf, run, s - run);
+        }
+        run = s + 1;
+        switch (c) {
+            case '"':  evbuffer_add(buf, "\\\"", 2); break;
+            case '\\': evbuffer_add(buf, "\\\\", 2); break;
+            case '/':  evbuffer_add(buf, "\\/", 2); break;
+            case '\b': evbuffer_add(buf, "\\b", 2); break;
+            case '\f': evbuffer_add(buf, "\\f", 2); break;
+            case '\n': evbuffer_add(buf, "\\n", 2); break;
+            case '\r': evbuffer_add(buf, "\\r", 2); break;
+            case '\t': evbuffer_add(buf, "\\t", 2); break;
+            default:
+                esc[4] = hex[c >> 4];
+                esc[5] = hex[c & 0xf];
+                evbuffer_add(buf, esc, 6);
+        }
+    }
+    if (s > run) {
+        evbuffer_add(buf, run, s - run);
+    }
+    evbuffer_add(buf, "\"", 1);
+}
+
+void json_add_int(struct evbuffer *buf, int i)
+{
+    char tmp[12], *p = tmp + sizeof(tmp);
+    unsigned int u = i < 0 ? -(unsigned int)i : (unsigned int)i;
+
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (i < 0) {
+        *--p = '-';
+    }
+    evbuffer_add(buf, p, tmp + sizeof(tmp) - p);
+}
+
+#define json_add_literal(buf, s) evbuffer_add(buf, s, sizeof(s) - 1)
+
+/*
+ *  Renders the parts of an element's JSON that only change on put_el.
+ *  Runs on the event thread under ns->lock, like every search.
+ */
+char *el_frag(struct el *e)
+{
+    static struct evbuffer *tmp = NULL;
+
+    if (!tmp) {
+        tmp = evbuffer_new();
+    }
+    json_add_literal(tmp, "{ \"key\": ");
+    json_add_string(tmp, e->ckey->key);
+    json_add_literal(tmp, ", \"id\": ");
+    json_add_string(tmp, e->ckey->id);
+    json_add_literal(tmp, ", \"when\": ");
+    e->frag_split = evbuffer_get_length(tmp);
+    if (e->data != NULL) {
+        json_add_literal(tmp, ", \"data\": ");
+        json_add_string(tmp, e->data);
+    }
+    json_add_literal(tmp, " }");
+    e->frag_len = evbuffer_get_length(tmp);
+    e->frag = malloc(e->frag_len);
+    evbuffer_remove(tmp, e->frag, e->frag_len);
+    count_add(C_ELEM_BYTES, e->frag_len);
+    ns_charge(e->ns, MEM_FRAGS, e->frag_len);
+    return e->frag;
+}
+
+void json_add_el(struct evbuffer *buf, struct el *e)
+{
+    /*
+     *  The fragment is copied, not referenced: the reply is written after
+     *  ns->lock is dropped and a put or del could free it by then.
+     */
+    if (frag_cache && (e->frag || el_frag(e))) {
+        evbuffer_add(buf, e->frag, e->frag_split);
+        json_add_int(buf, e->when);
+        json_add_literal(buf, ", \"count\": ");
+        json_add_int(buf, e->count);
+        evbuffer_add(buf, e->frag + e->frag_split, e->frag_len - e->frag_split);
+        return;
+    }
+    json_add_literal(buf, "{ \"key\": ");
+    json_add_string(buf, e->ckey->key);
+    json_add_literal(buf, ", \"id\": ");
+    json_add_string(buf, e->ckey->id);
+    json_add_literal(buf, ", \"when\": ");
+    json_add_int(buf, e->when);
+    json_add_literal(buf, ", \"count\": ");
+    json_add_int(buf, e->count);
+    if (e->data != NULL) {
+        json_add_literal(buf, ", \"data\": ");
+        json_add_string(buf, e->data);
+    }
+    json_add_literal(buf, " }");
+}
+
+/*
+ *  Rendered search results, keyed by the raw query and tagged with the
+ *  namespace version they were rendered from. Only the event thread
+ *  touches the cache so it has no lock.
+ */
+struct cached_results {
+    char *qkey;
+    int qlen;
+    uint64_t version;
+    char *body;
+    size_t len;
+    int nresults;
+    struct cached_results *prev, *next;  /* lru, most recent first */
+    UT_hash_handle hh;
+};
+
+struct cached_results *results_cache = NULL, *results_lru = NULL;
+size_t results_cache_bytes = 0;
+
+int parse_sort(const char *s)
+{
+    return strcmp(s, "frecency") == 0 ? SORT_FRECENCY : SORT_TIME;
+}
+
+int parse_match(const char *s)
+{
+    return strcmp(s, "word") == 0 ? MATCH_WORD : strcmp(s, "infix") == 0 ? MATCH_INFIX : MATCH_PREFIX;
+}
+
+int parse_fuzzy(const char *s)
+{
+    int n = atoi(s);
+
+    return n < 0 ? 0 : n > MAX_FUZZY ? MAX_FUZZY : n;
+}
+
+/*
+ *  Serializes everything that changes a query's results. Absent args
+ *  are kept distinct from empty ones since id="" filters and no id
+ *  does not.
+ */
+char *query_key(UT_string *s, struct query *q)
+{
+    char buf[48];
+    char *fields[4];
+    int i;
+
+    fields[0] = q->namespace;
+    fields[1] = q->key;
+    fields[2] = q->id;
+    fields[3] = q->locale;
+    for (i=0; i < 4; i++) {
+        if (fields[i]) {
+            utstring_bincpy(s, "+", 1);
+            utstring_bincpy(s, fields[i], strlen(fields[i]) + 1);
+        } else {
+            utstring_bincpy(s, "-", 2);
+        }
+    }
+    i = snprintf(buf, sizeof(buf), "%d:%ld:%d:%d:%d", q->limit, (long)q->when, q->sort, q->match, q->fuzzy);
+    utstring_bincpy(s, buf, i);
+    return utstring_body(s);
+}
+
+uint64_t fnv1a(const char *s, int len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (len--) {
+        h ^= (uint8_t)*s++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+void free_cached_results(struct cached_results *c)
+{
+    HASH_DEL(results_cache, c);
+    DL_DELETE(results_lru, c);
+    results_cache_bytes -= c->qlen + c->len;
+    free(c->qkey);
+    free(c->body);
+    free(c);
+}
+
+/*
+ *  Returns the number of results added to buf, or -1 on a miss.
+ */
+int get_cached_results(UT_string *qkey, uint64_t version, struct evbuffer *buf)
+{
+    struct cached_results *c;
+
+    HASH_FIND(hh, results_cache, utstring_body(qkey), utstring_len(qkey), c);
+    if (!c) {
+        return -1;
+    }
+    if (c->version != version) {
+        free_cached_results(c);
+        return -1;
     }
-    safe_free(e->data);
-    e->data = safe_strdup(data);
-    e->when = when;
-    HASH_ADD_KEYPTR(hh, ns->elems, e->ckey->data, KEY_LEN(e->ckey), e);
-    if (mark) {
-        ns->dirty += 1;
+    DL_DELETE(results_lru, c);
+    DL_PREPEND(results_lru, c);
+    evbuffer_add(buf, c->body, c->len);
+    return c->nresults;
+}
+
+void put_cached_results(UT_string *qkey, uint64_t version, struct evbuffer *results, int nresults)
+{
+    struct cached_results *c;
+    size_t len = evbuffer_get_length(results);
+
+    if (len + utstring_len(qkey) > results_cache_max / 8) {
+        return;
     }
-    pthread_mutex_unlock(&ns->lock);
+    while (results_lru && results_cache_bytes + len + utstring_len(qkey) > results_cache_max) {
+        free_cached_results(results_lru->prev);
+    }
+    c = malloc(sizeof(*c));
+    c->qlen = utstring_len(qkey);
+    c->qkey = malloc(c->qlen);
+    memcpy(c->qkey, utstring_body(qkey), c->qlen);
+    c->version = version;
+    c->nresults = nresults;
+    c->len = len;
+    c->body = malloc(len);
+    evbuffer_copyout(results, c->body, len);
+    HASH_ADD_KEYPTR(hh, results_cache, c->qkey, c->qlen, c);
+    DL_PREPEND(results_lru, c);
+    results_cache_bytes += c->qlen + c->len;
+}
 
-    return e;
+/*
+ *  A cursor keeps the full, sorted match set of a search so the next
+ *  keystroke can filter it instead of scanning the namespace. The el
+ *  pointers are only trusted while the namespace version is unchanged.
+ *  Like the results cache, cursors belong to the event thread.
+ */
+struct cursor {
+    char token[17];
+    char *namespace;
+    composite_key *ckey;
+    int has_id;
+    int sort;
+    int match;
+    int fuzzy;
+    uint64_t version;
+    time_t expires;
+    struct el **elems;
+    int nelems;
+    struct cursor *prev, *next;  /* lru, most recent first */
+    UT_hash_handle hh;
+};
+
+struct cursor *cursors = NULL, *cursors_lru = NULL;
+int ncursors = 0;
+
+void free_cursor(struct cursor *c)
+{
+    HASH_DEL(cursors, c);
+    DL_DELETE(cursors_lru, c);
+    ncursors--;
+    safe_free(c->namespace);
+    safe_free(c->ckey);
+    safe_free(c->elems);
+    free(c);
 }
 
-void load_namespace(char *namespace)
+struct cursor *new_cursor()
 {
-    struct el *e;
-    UT_string *ustr;
-    int fd, n, klen, dlen, ilen;
-    char *key = NULL, *id = NULL, *data = NULL;
-    struct hdr {
-        uint32_t klen;
-        uint32_t ilen;
-        uint32_t dlen;
-        uint32_t when;
-        uint32_t count;
-    } hdr;
-    
-    if (!db_dir || !namespace) {
-        return;
+    static uint32_t seq = 0;
+    struct cursor *c;
+    time_t now = time(NULL);
+
+    while (cursors_lru && (ncursors >= MAX_CURSORS || cursors_lru->prev->expires <= now)) {
+        free_cursor(cursors_lru->prev);
     }
-    
-    utstring_new(ustr);
-    namespace_path(ustr, namespace);
-    fd = open(utstring_body(ustr), O_RDONLY);
-    if (fd == -1) {
-        fprintf(stderr, "open() failed: %s: %s\n", utstring_body(ustr), strerror(errno));
-        utstring_free(ustr);
-        return;
+    c = malloc(sizeof(*c));
+    memset(c, 0, sizeof(*c));
+    snprintf(c->token, sizeof(c->token), "%08x%08x", ++seq, (uint32_t)random());
+    HASH_ADD_STR(cursors, token, c);
+    DL_PREPEND(cursors_lru, c);
+    ncursors++;
+    return c;
+}
+
+/*
+ *  Returns a live cursor for token, or NULL if it expired, was evicted
+ *  or was opened on another namespace.
+ */
+struct cursor *find_cursor(char *token, char *namespace)
+{
+    struct cursor *c = NULL;
+
+    HASH_FIND_STR(cursors, token, c);
+    if (c && (c->expires <= time(NULL) || strcmp(c->namespace, namespace) != 0)) {
+        free_cursor(c);
+        c = NULL;
     }
-    n = read(fd, &hdr, sizeof(hdr));
-    fprintf(stderr, "loading: %s from %s\n", namespace, utstring_body(ustr));
-    while (n == sizeof(hdr)) {
-        klen = ntohl(hdr.klen);
-        ilen = ntohl(hdr.ilen);
-        dlen = ntohl(hdr.dlen);
-        key = realloc(key, klen);
-        id = realloc(id, ilen);
-        data = realloc(data, dlen);
-        n = read(fd, key, klen);
-        n = read(fd, id, ilen);
-        n = read(fd, data, dlen);
-        e = put_el(namespace, NULL, key, id, data, ntohl(hdr.when), 0);
-        e->count = ntohl(hdr.count);
-        n = read(fd, &hdr, sizeof(hdr));
+    return c;
+}
+
+/*
+ *  True when every match for ckey is already among c's elements, in
+ *  the right order: the namespace is unchanged, the id filter, sort
+ *  and match are the same and the new key extends the old one. Fuzzy
+ *  results are ordered by distance, which a longer key changes, so
+ *  they are never refined, and infix ones only once the old key was
+ *  long enough to be searched as a substring.
+ */
+int cursor_covers(struct cursor *c, struct namespace *ns, composite_key *ckey, int has_id, struct query *q)
+{
+    return c->elems && c->version == ns->version && c->has_id == has_id &&
+        c->sort == q->sort && c->match == q->match && !c->fuzzy && !q->fuzzy &&
+        (q->match != MATCH_INFIX || c->ckey->len[0] >= GRAM_LEN) &&
+        (!has_id || strcmp(c->ckey->id, ckey->id) == 0) &&
+        ckey->len[0] >= c->ckey->len[0] &&
+        strncmp(ckey->key, c->ckey->key, c->ckey->len[0]) == 0;
+}
+
+/*
+ *  Newest first means everything after the first element at or before
+ *  q->when is too old; any other order has to skip those one by one.
+ */
+int render_results(struct evbuffer *out, struct query *q, struct el **elems, int n)
+{
+    int i, j;
+
+    json_add_literal(out, "[");
+    for (i=0, j=0; j < n && i < q->limit; j++) {
+        if (elems[j]->when <= q->when) {
+            if (q->sort == SORT_TIME && !q->fuzzy) {
+                break;
+            }
+            continue;
+        }
+        if (i++) {
+            json_add_literal(out, ", ");
+        } else {
+            json_add_literal(out, " ");
+        }
+        json_add_el(out, elems[j]);
     }
-    close(fd);
-    safe_free(key);
-    safe_free(id);
-    safe_free(data);
-    utstring_free(ustr);
+    json_add_literal(out, " ]");
+    return i;
 }
 
-void save_namespace(struct namespace *ns)
+/*
+ *  Typo tolerant prefix search: keys with a prefix within q->fuzzy
+ *  edits of the query. The key trie is walked with one row of the
+ *  Levenshtein table per code point of the path, which is the
+ *  automaton for the query run over every key at once; a subtree is
+ *  left as soon as its row shows no path through it can get back
+ *  within the limit, so only reachable nodes are visited. A key's
+ *  distance is the best any of its prefixes reached. Once a path's
+ *  distance is no more than anything left in its row, every key under
+ *  it has that distance and the subtree is collected without rows, so
+ *  the recursion only goes max edits past the query's length.
+ */
+#define MAX_FUZZY_LEN 64
+
+struct fuzzy_hit {
+    struct el *e;
+    int dist;
+};
+
+struct fuzzy {
+    UChar32 q[MAX_FUZZY_LEN];
+    int m;
+    int max;
+    composite_key *ckey;
+    int has_id;
+    time_t now;
+    struct el **expired;
+    struct fuzzy_hit *hits;
+    int nhits;
+    int size;
+    int visited;
+};
+
+void fuzzy_add(struct fuzzy *f, struct trie *t, int dist)
 {
     struct el *e;
-    UT_string *path1, *path2;
-    int fd, ok, n;
-    struct hdr {
-        uint32_t klen;
-        uint32_t ilen;
-        uint32_t dlen;
-        uint32_t when;
-        uint32_t count;
-    } hdr;
-    
-    if (!db_dir || !ns) {
-        return;
+
+    for (e=t->elems; e; e=e->trie_next) {
+        if (f->has_id && strcmp(e->ckey->id, f->ckey->id) != 0) {
+            continue;
+        }
+        if (el_expired(e, f->now)) {
+            expire_later(f->expired, e);
+            continue;
+        }
+        if (f->nhits == f->size) {
+            f->size = f->size ? f->size * 2 : 16;
+            f->hits = realloc(f->hits, f->size * sizeof(*f->hits));
+        }
+        f->hits[f->nhits].e = e;
+        f->hits[f->nhits++].dist = dist;
     }
-    fprintf(stderr, "save_namespace %s %d\n", ns->name, ns->dirty);
-    
-    utstring_new(path1);
-    namespace_path(path1, ns->name);
-    utstring_bincpy(path1, ".tmp", 5);
-    fd = open(utstring_body(path1), O_CREAT|O_TRUNC|O_RDWR, 0660);
-    if (fd == -1) {
-        fprintf(stderr, "open failed: %s: %s\n", utstring_body(path1), strerror(errno));
-        utstring_free(path1);
-        return;
+}
+
+void fuzzy_collect(struct fuzzy *f, struct trie *t, int dist)
+{
+    struct trie *node;
+
+    for (node=t; node; node=trie_next(node, t)) {
+        f->visited++;
+        fuzzy_add(f, node, dist);
     }
-    
-    pthread_mutex_lock(&ns->lock);
-    for (ok=1, e=ns->elems; e != NULL; e=e->hh.next) {
-        hdr.klen = htonl(e->ckey->len[0]+1);
-        hdr.ilen = htonl(e->ckey->len[1]+1);
-        if (e->data != NULL) {
-            hdr.dlen = htonl(strlen(e->data)+1);
+}
+
+void fuzzy_walk(struct fuzzy *f, struct trie *t, int *row, int best, UChar32 cp, int pending)
+{
+    struct trie *c;
+    int next[MAX_FUZZY_LEN + 1], j, low, nbest, npending;
+    UChar32 ncp;
+
+    f->visited++;
+    if (!pending && best <= f->max) {
+        fuzzy_add(f, t, best);
+    }
+    for (c=t->child; c; c=c->sibling) {
+        /* the row only moves once a whole UTF-8 sequence is in */
+        if (pending) {
+            ncp = (cp << 6) | (c->c & 0x3f);
+            npending = pending - 1;
+        } else if (c->c < 0xc0) {
+            ncp = c->c;
+            npending = 0;
         } else {
-            hdr.dlen = 0;
-        }        
-        hdr.when = htonl(e->when);
-        hdr.count = htonl(e->count);
-        n = write(fd, &hdr, sizeof(hdr));
-        if (n == -1) {
-            fprintf(stderr, "write failed: %s: %s\n", utstring_body(path1), strerror(errno));
-            ok = 0;
-            break;
+            npending = c->c < 0xe0 ? 1 : c->c < 0xf0 ? 2 : 3;
+            ncp = c->c & (0x3f >> npending);
         }
-        write(fd, e->ckey->key, e->ckey->len[0]+1);
-        write(fd, e->ckey->id, e->ckey->len[1]+1);
-        if (e->data != NULL) {
-            write(fd, e->data, strlen(e->data)+1);
+        if (npending) {
+            fuzzy_walk(f, c, row, best, ncp, npending);
+            continue;
+        }
+        next[0] = low = row[0] + 1;
+        for (j=1; j <= f->m; j++) {
+            next[j] = row[j - 1] + (f->q[j - 1] != ncp);
+            if (row[j] + 1 < next[j]) {
+                next[j] = row[j] + 1;
+            }
+            if (next[j - 1] + 1 < next[j]) {
+                next[j] = next[j - 1] + 1;
+            }
+            if (next[j] < low) {
+                low = next[j];
+            }
+        }
+        nbest = next[f->m] < best ? next[f->m] : best;
+        if (nbest <= f->max && nbest <= low) {
+            fuzzy_collect(f, c, nbest);
+        } else if (low <= f->max) {
+            fuzzy_walk(f, c, next, nbest, 0, 0);
         }
     }
-    pthread_mutex_unlock(&ns->lock);
+}
 
-    utstring_new(path2);
-    namespace_path(path2, ns->name);
-    if (ok) {
-        rename(utstring_body(path1), utstring_body(path2));
-        ns->dirty = 0;
+int fuzzy_time_sort(const void *a, const void *b)
+{
+    const struct fuzzy_hit *x = a, *y = b;
+
+    return x->dist != y->dist ? x->dist - y->dist : time_count_sort(x->e, y->e);
+}
+
+int fuzzy_frecency_sort(const void *a, const void *b)
+{
+    const struct fuzzy_hit *x = a, *y = b;
+
+    return x->dist != y->dist ? x->dist - y->dist : frecency_sort(x->e, y->e);
+}
+
+/*
+ *  Returns the matches in order in *elems and how many there are.
+ *  Call with ns->lock held.
+ */
+int fuzzy_search(struct namespace *ns, struct query *q, composite_key *ckey,
+                 struct el **expired, struct el ***elems)
+{
+    struct fuzzy f;
+    int row[MAX_FUZZY_LEN + 1], i = 0, j;
+
+    memset(&f, 0, sizeof(f));
+    while (i < ckey->len[0] && f.m < MAX_FUZZY_LEN) {
+        U8_NEXT(ckey->key, i, ckey->len[0], f.q[f.m]);
+        f.m++;
     }
-    close(fd);
-    utstring_free(path1);
-    utstring_free(path2);
+    /* past this every key is a match on the strength of its first letters */
+    f.max = q->fuzzy < f.m ? q->fuzzy : f.m ? f.m - 1 : 0;
+    f.ckey = ckey;
+    f.has_id = q->id != NULL;
+    f.now = time(NULL);
+    f.expired = expired;
+    for (j=0; j <= f.m; j++) {
+        row[j] = j;
+    }
+    if (!ns->trie) {
+        trie_build(ns);
+    }
+    if (f.m <= f.max) {
+        fuzzy_collect(&f, ns->trie, f.m);
+    } else {
+        fuzzy_walk(&f, ns->trie, row, f.m, 0, 0);
+    }
+    qsort(f.hits, f.nhits, sizeof(*f.hits), q->sort == SORT_FRECENCY ? fuzzy_frecency_sort : fuzzy_time_sort);
+    *elems = malloc((f.nhits ? f.nhits : 1) * sizeof(**elems));
+    for (j=0; j < f.nhits; j++) {
+        (*elems)[j] = f.hits[j].e;
+    }
+    safe_free(f.hits);
+    if (cur_trace) {
+        cur_trace->scanned += f.visited;
+        cur_trace->matches += f.nhits;
+    }
+    return f.nhits;
 }
 
-void save_namespaces()
+/*
+ *  Adds the elements whose key contains ckey's to results, going
+ *  through the trigram index only: the posting lists of the key's
+ *  runs are intersected, shortest first, and the survivors checked
+ *  for the whole key. Keys too short for a run are taken as prefixes
+ *  and looked up in the key trie. Namespaces without infix get
+ *  nothing. Returns how many elements were looked at.
+ */
+int grams_collect(struct namespace *ns, composite_key *ckey, int has_id, struct el **results)
 {
-    struct namespace *ns, *results = NULL;
-    int i;
-    
-    pthread_mutex_lock(&master_lock);
-    HASH_SELECT(dh, results, hh, spaces, dirty_match);
-    pthread_mutex_unlock(&master_lock);
-    for (ns=results, i=0; ns != NULL; ns=ns->dh.next, i++) {
-        save_namespace(ns);
+    struct gram **grs, *gr;
+    struct trie *node;
+    struct el *e, **elems = NULL;
+    uint32_t g, *a, *b = NULL;
+    int i, j, n = 0, ngrams, size = 0;
+
+    if (!ns->infix) {
+        return 0;
     }
-    HASH_CLEAR(dh, results);
+    if (ckey->len[0] < GRAM_LEN) {
+        if (!ns->trie) {
+            trie_build(ns);
+        }
+        if ((node = trie_find(ns->trie, ckey->key, ckey->len[0]))) {
+            trie_collect(node, has_id ? ckey->id : NULL, &elems, &n, &size);
+        }
+        for (i=0; i < n; i++) {
+            HASH_ADD_KEYPTR(rh, *results, elems[i]->ckey->data, KEY_LEN(elems[i]->ckey), elems[i]);
+        }
+        safe_free(elems);
+        return n;
+    }
+    if (!ns->gram_elems) {
+        grams_build(ns);
+    }
+    ngrams = ckey->len[0] - GRAM_LEN + 1;
+    grs = malloc(ngrams * sizeof(*grs));
+    for (i=0; i < ngrams; i++) {
+        g = gram_of(ckey->key + i);
+        HASH_FIND(hh, ns->grams, &g, sizeof(g), grs[i]);
+        if (!grs[i]) {
+            free(grs);
+            return 0;
+        }
+        /* shortest first keeps every intermediate set small */
+        for (j=i; j > 0 && grs[j - 1]->n > grs[j]->n; j--) {
+            gr = grs[j];
+            grs[j] = grs[j - 1];
+            grs[j - 1] = gr;
+        }
+    }
+    a = malloc(grs[0]->n * sizeof(*a));
+    n = gram_decode(grs[0], a);
+    for (i=1; i < ngrams && n; i++) {
+        if (grs[i] == grs[i - 1]) {
+            continue;
+        }
+        if (grs[i]->n > size) {
+            size = grs[i]->n;
+            b = realloc(b, size * sizeof(*b));
+        }
+        n = gids_intersect(a, n, b, gram_decode(grs[i], b), a);
+    }
+    for (i=0; i < n; i++) {
+        e = ns->gram_elems[a[i]];
+        if (e && (!has_id || strcmp(e->ckey->id, ckey->id) == 0) && strstr(e->ckey->key, ckey->key)) {
+            HASH_ADD_KEYPTR(rh, *results, e->ckey->data, KEY_LEN(e->ckey), e);
+        }
+    }
+    free(grs);
+    free(a);
+    safe_free(b);
+    return n;
 }
 
-void *backup_thread(void *ctx)
+/*
+ *  Appends the results array for one query to buf and returns how many
+ *  results it holds. If q->cursor is set the matches are kept in a
+ *  cursor, whose token is left in q->next_cursor.
+ */
+int search_namespace(struct query *q, struct evbuffer *buf)
 {
-    pthread_mutex_lock(&master_lock);
-    while (is_running) {
-        pthread_cond_wait(&backup_cond, &master_lock);
-        pthread_mutex_unlock(&master_lock);
-        save_namespaces();
+    composite_key *ckey;
+    struct el *e, *next, *tmp, *results = NULL, *expired = NULL, **elems = NULL;
+    struct namespace *ns;
+    struct cursor *c = NULL;
+    struct trie *node;
+    struct evbuffer *out;
+    UT_string *qkey = NULL;
+    uint64_t t;
+    time_t now = time(NULL);
+    int i, n = 0, new, nresults, size = 0, scanned = 0;
+
+    if (!namespace_exists(q->namespace)) {
+        /*
+         *  Nothing to remember for a cursor either; "1" just opens one
+         *  on the next keystroke.
+         */
+        if (q->cursor) {
+            strcpy(q->next_cursor, "1");
+        }
+        json_add_literal(buf, "[ ]");
+        return 0;
+    }
+    ns = create_namespace(q->namespace, &new);
+    if (q->cursor) {
+        if (strcmp(q->cursor, "1") != 0) {
+            c = find_cursor(q->cursor, q->namespace);
+        }
+        if (!c) {
+            c = new_cursor();
+            c->namespace = strdup(q->namespace);
+        }
+        c->expires = time(NULL) + CURSOR_TTL;
+        DL_DELETE(cursors_lru, c);
+        DL_PREPEND(cursors_lru, c);
+        strcpy(q->next_cursor, c->token);
+    } else if (results_cache_max) {
+        expire_check(ns, time(NULL));
+        utstring_new(qkey);
+        query_key(qkey, q);
+        if ((nresults = get_cached_results(qkey, ns->version, buf)) >= 0) {
+            utstring_free(qkey);
+            return nresults;
+        }
+    }
+
+    ckey = make_key(q->locale, q->key, q->id);
+    if (!ckey) {
+        json_add_literal(buf, "[ ]");
+        if (qkey) {
+            utstring_free(qkey);
+        }
+        return 0;
+    }
+
+    for (i=0, n=0; q->fuzzy && i < ckey->len[0]; n++) {
+        U8_FWD_1(ckey->key, i, ckey->len[0]);
+    }
+    if (n > MAX_FUZZY_LEN) {
+        /* too long for a typo to matter much, see fuzzy_search() */
+        q->fuzzy = 0;
+    }
+    n = 0;
+
+    out = evbuffer_new();
+    lock_namespace(ns);
+    t = now_usec();
+    if (c && cursor_covers(c, ns, ckey, q->id != NULL, q)) {
+        /*
+         *  The old set is already sorted and filtering keeps the order.
+         */
+        for (i=0; i < c->nelems; i++) {
+            if (el_expired(c->elems[i], now)) {
+                expire_later(&expired, c->elems[i]);
+            } else if (q->match == MATCH_WORD ? word_match(c->elems[i], ckey->key, ckey->len[0]) :
+                       q->match == MATCH_INFIX ? strstr(c->elems[i]->ckey->key, ckey->key) != NULL :
+                       key_match(c->elems[i])) {
+                c->elems[n++] = c->elems[i];
+            }
+        }
+        if (cur_trace) {
+            cur_trace->scanned += c->nelems;
+            cur_trace->matches += n;
+        }
+        c->nelems = n;
+        t = stat_since(STAT_SELECT, t);
+        nresults = render_results(out, q, c->elems, n);
+        stat_since(STAT_SERIALIZE, t);
+    } else if (q->fuzzy) {
+        n = fuzzy_search(ns, q, ckey, &expired, &elems);
+        t = stat_since(STAT_SELECT, t);
+        nresults = render_results(out, q, elems, n);
+        stat_since(STAT_SERIALIZE, t);
+        if (c) {
+            safe_free(c->elems);
+            c->elems = elems;
+            c->nelems = n;
+        } else {
+            free(elems);
+        }
+    } else if (q->sort == SORT_FRECENCY && q->match == MATCH_PREFIX) {
+        /*
+         *  The ranking is already in order, so without a cursor the
+         *  walk stops at the limit'th match.
+         */
+        if (!ns->rank_built) {
+            rank_build(ns);
+        }
+        for (e=ns->ranked[0]; e && (c || n < q->limit); e=next) {
+            next = e->rank_next[0];
+            scanned++;
+            if (el_expired(e, now)) {
+                expire_later(&expired, e);
+            } else if ((q->id ? key_id_match(e) : key_match(e)) && (c || e->when > q->when)) {
+                if (n == size) {
+                    size = size ? size * 2 : 16;
+                    elems = realloc(elems, size * sizeof(*elems));
+                }
+                elems[n++] = e;
+            }
+        }
+        if (cur_trace) {
+            cur_trace->scanned += scanned;
+            cur_trace->matches += n;
+        }
+        t = stat_since(STAT_SELECT, t);
+        nresults = render_results(out, q, elems, n);
+        stat_since(STAT_SERIALIZE, t);
+        if (c) {
+            safe_free(c->elems);
+            c->elems = elems ? elems : malloc(sizeof(*elems));
+            c->nelems = n;
+        } else {
+            safe_free(elems);
+        }
+    } else {
+        if (q->match == MATCH_WORD) {
+            if (!ns->words) {
+                words_build(ns);
+            }
+            if ((node = trie_find(ns->words, ckey->key, ckey->len[0]))) {
+                scanned = words_collect(node, ckey, q->id != NULL, &results);
+            }
+        } else if (q->match == MATCH_INFIX) {
+            scanned = grams_collect(ns, ckey, q->id != NULL, &results);
+        } else if (ns->compact_elems) {
+            /* both tables, a search never finishes a compaction */
+            for (e=first_el(ns); e != NULL; e=next_el(ns, e)) {
+                if (q->id ? key_id_match(e) : key_match(e)) {
+                    HASH_ADD_KEYPTR(rh, results, e->ckey->data, KEY_LEN(e->ckey), e);
+                }
+            }
+            scanned = count_els(ns);
+        } else {
+            if (q->id) {
+                HASH_SELECT(rh, results, hh, ns->elems, key_id_match);
+            } else {
+                HASH_SELECT(rh, results, hh, ns->elems, key_match);
+            }
+            scanned = HASH_COUNT(ns->elems);
+        }
+        if (cur_trace) {
+            cur_trace->scanned += scanned;
+            cur_trace->matches += HASH_CNT(rh, results);
+        }
+        HASH_ITER(rh, results, e, tmp) {
+            if (el_expired(e, now)) {
+                HASH_DELETE(rh, results, e);
+                expire_later(&expired, e);
+            }
+        }
+        t = stat_since(STAT_SELECT, t);
+        if (q->sort == SORT_FRECENCY) {
+            HASH_SRT(rh, results, frecency_sort);
+        } else {
+            HASH_SRT(rh, results, time_count_sort);
+        }
+        t = stat_since(STAT_SORT, t);
+        if (c || q->sort != SORT_TIME) {
+            n = HASH_CNT(rh, results);
+            elems = realloc(c ? c->elems : NULL, sizeof(*elems) * (n ? n : 1));
+            for (e=results, i=0; e != NULL; e=e->rh.next, i++) {
+                elems[i] = e;
+            }
+            nresults = render_results(out, q, elems, n);
+            if (c) {
+                c->elems = elems;
+                c->nelems = n;
+            } else {
+                free(elems);
+            }
+        } else {
+            json_add_literal(out, "[");
+            for (e=results, i=0; e != NULL && i < q->limit && e->when > q->when; e=e->rh.next, i++) {
+                if (i) {
+                    json_add_literal(out, ", ");
+                } else {
+                    json_add_literal(out, " ");
+                }
+                json_add_el(out, e);
+            }
+            json_add_literal(out, " ]");
+            nresults = i;
+        }
+        stat_since(STAT_SERIALIZE, t);
+        HASH_CLEAR(rh, results);
     }
-    return NULL;
-}
+    pthread_mutex_unlock(&ns->lock);
+    expire_list(&expired);
 
-void backup(int timer_fd, short event, void *arg)
-{
-    evtimer_set(&backup_timer, backup, NULL);
-    pthread_mutex_lock(&master_lock);
-    pthread_cond_signal(&backup_cond);
-    pthread_mutex_unlock(&master_lock);
-    evtimer_add(&backup_timer, &backup_tv);
+    if (c) {
+        safe_free(c->ckey);
+        c->ckey = ckey;
+        c->has_id = q->id != NULL;
+        c->sort = q->sort;
+        c->match = q->match;
+        c->fuzzy = q->fuzzy;
+        c->version = ns->version;
+    } else {
+        safe_free(ckey);
+    }
+    if (qkey) {
+        put_cached_results(qkey, ns->version, out, nresults);
+        utstring_free(qkey);
+    }
+    evbuffer_add_buffer(buf, out);
+    evbuffer_free(out);
+    return nresults;
 }
 
-void put_cb(struct evhttp_request *req, void *arg)
+void search_cb(struct evhttp_request *req, void *arg)
 {
     struct evbuffer *buf = evbuffer_new();
     struct evkeyvalq args;
-    struct el *e;
-    char *namespace, *key, *id, *data, *ts, *locale;
-    time_t when = time(NULL);
-
-    fprintf(stderr, "%s\n", req->uri);
+    uint64_t start = now_usec();
+    struct namespace *ns;
+    struct query q;
+    UT_string *qkey;
+    char *slimit, *ts, *sort, *match, *fuzzy, etag[40];
+    const char *inm;
+    int new, results = -1;
+    struct trace trace;
+    uint64_t version;
+    
     evhttp_parse_query(req->uri, &args);
-    namespace = (char *)evhttp_find_header(&args, "namespace");
-    key =       (char *)evhttp_find_header(&args, "key");
-    data =      (char *)evhttp_find_header(&args, "data");
-    id =        (char *)evhttp_find_header(&args, "id");
-    locale =    (char *)evhttp_find_header(&args, "locale");
-    ts =        (char *)evhttp_find_header(&args, "ts");
+    memset(&q, 0, sizeof(q));
+    q.limit = DEFAULT_LIMIT;
+    q.namespace = (char *)evhttp_find_header(&args, "namespace");
+    q.key =       (char *)evhttp_find_header(&args, "key");
+    q.id =        (char *)evhttp_find_header(&args, "id");
+    q.locale =    (char *)evhttp_find_header(&args, "locale");
+    slimit =      (char *)evhttp_find_header(&args, "limit");
+    ts =          (char *)evhttp_find_header(&args, "ts");
+    q.cursor =    (char *)evhttp_find_header(&args, "cursor");
+    sort =        (char *)evhttp_find_header(&args, "sort");
+    match =       (char *)evhttp_find_header(&args, "match");
+    fuzzy =       (char *)evhttp_find_header(&args, "fuzzy");
+    trace_begin(&trace, q.namespace, q.key);
+    if (slimit) {
+        q.limit = atoi(slimit);
+    }
+    if (sort) {
+        q.sort = parse_sort(sort);
+    }
+    if (match) {
+        q.match = parse_match(match);
+    }
+    if (fuzzy) {
+        q.fuzzy = parse_fuzzy(fuzzy);
+    }
     if (ts) {
-        when = (time_t)strtol(ts, NULL, 10);
+        q.when = (time_t)strtol(ts, NULL, 10);
+    }
+    
+    if (q.namespace && !q.cursor) {
+        /*
+         *  The version is all we need to answer a revalidation, so check
+         *  If-None-Match before any normalizing or scanning. Cursor
+         *  responses carry a token and are never the same twice.
+         */
+        version = 0;
+        if (namespace_exists(q.namespace)) {
+            ns = create_namespace(q.namespace, &new);
+            expire_check(ns, time(NULL));
+            version = ns->version;
+        }
+        utstring_new(qkey);
+        query_key(qkey, &q);
+        snprintf(etag, sizeof(etag), "\"%llx-%llx\"", (unsigned long long)version,
+                 (unsigned long long)fnv1a(utstring_body(qkey), utstring_len(qkey)));
+        utstring_free(qkey);
+        evhttp_add_header(req->output_headers, "ETag", etag);
+        inm = evhttp_find_header(req->input_headers, "If-None-Match");
+        if (inm && strstr(inm, etag)) {
+            evhttp_send_reply(req, HTTP_NOTMODIFIED, "Not Modified", NULL);
+            evhttp_clear_headers(&args);
+            evbuffer_free(buf);
+            log_access(req, STAT_SEARCH, -1, start);
+            enforce_budget();
+            return;
+        }
     }
 
-    if (namespace && key) {
-        e = put_el(namespace, locale, key, id, data, when, 1);
-        if (e) {
-            e->count += 1;
-            evhttp_send_reply(req, HTTP_OK, "OK", buf);
-        } else {
-            evhttp_send_reply(req, HTTP_INTERNAL, "ERR", buf);
+    if (q.namespace) {
+        json_add_literal(buf, "{ \"results\": ");
+        results = search_namespace(&q, buf);
+        if (q.cursor) {
+            json_add_literal(buf, ", \"cursor\": ");
+            json_add_string(buf, q.next_cursor);
         }
+        json_add_literal(buf, " }\n");
+        evhttp_send_reply(req, HTTP_OK, "OK", buf);
     } else {
         evhttp_send_reply(req, HTTP_BADREQUEST, "MISSING_REQ_ARG", buf);
     }
-
+    
     evhttp_clear_headers(&args);
     evbuffer_free(buf);
+    log_access(req, STAT_SEARCH, results, start);
+    enforce_budget();
 }
 
-void del_cb(struct evhttp_request *req, void *arg)
+/*
+ *  Args are read in order. Each namespace arg starts a new query and
+ *  the key, id, locale, limit, ts, cursor, sort, match and fuzzy args
+ *  after it apply to that query.
+ *  Args given before the first namespace are defaults for every query.
+ *
+ *    /msearch?limit=10&key=tw&namespace=user1&namespace=shared&limit=5
+ */
+int parse_msearch(struct evkeyvalq *args, struct query *queries, int max)
+{
+    struct evkeyval *kv;
+    struct query defaults, *q = &defaults;
+    int n = 0;
+
+    memset(&defaults, 0, sizeof(defaults));
+    defaults.limit = DEFAULT_LIMIT;
+    TAILQ_FOREACH(kv, args, next) {
+        if (strcmp(kv->key, "namespace") == 0) {
+            if (n == max) {
+                return -1;
+            }
+            q = &queries[n++];
+            *q = defaults;
+            q->namespace = kv->value;
+        } else if (strcmp(kv->key, "key") == 0) {
+            q->key = kv->value;
+        } else if (strcmp(kv->key, "id") == 0) {
+            q->id = kv->value;
+        } else if (strcmp(kv->key, "locale") == 0) {
+            q->locale = kv->value;
+        } else if (strcmp(kv->key, "limit") == 0) {
+            q->limit = atoi(kv->value);
+        } else if (strcmp(kv->key, "ts") == 0) {
+            q->when = (time_t)strtol(kv->value, NULL, 10);
+        } else if (strcmp(kv->key, "cursor") == 0) {
+            q->cursor = kv->value;
+        } else if (strcmp(kv->key, "sort") == 0) {
+            q->sort = parse_sort(kv->value);
+        } else if (strcmp(kv->key, "match") == 0) {
+            q->match = parse_match(kv->value);
+        } else if (strcmp(kv->key, "fuzzy") == 0) {
+            q->fuzzy = parse_fuzzy(kv->value);
+        }
+    }
+    return n;
+}
+
+void msearch_cb(struct evhttp_request *req, void *arg)
 {
     struct evbuffer *buf = evbuffer_new();
     struct evkeyvalq args;
-    struct namespace *ns;
-    composite_key *ckey;
-    struct el *e;
-    char *namespace, *key, *id, *locale;
-    
-    fprintf(stderr, "%s\n", req->uri);
+    uint64_t start = now_usec();
+    struct query queries[MAX_MSEARCH];
+    int i, n, results = 0;
+
     evhttp_parse_query(req->uri, &args);
-    namespace = (char *)evhttp_find_header(&args, "namespace");
-    key =       (char *)evhttp_find_header(&args, "key");
-    id =        (char *)evhttp_find_header(&args, "id");
-    locale =    (char *)evhttp_find_header(&args, "locale");
-    
-    if (namespace && key) {
-        ns = get_namespace(namespace);
-        ckey = make_key(locale, key, id);
-        if (ns && ckey) {
-            pthread_mutex_lock(&ns->lock);            
-            HASH_FIND(hh, ns->elems, ckey->data, KEY_LEN(ckey), e);
-            if (e) {
-                HASH_DEL(ns->elems, e);
+    n = parse_msearch(&args, queries, MAX_MSEARCH);
+
+    if (n > 0) {
+        /*
+         *  All requests are served from the event thread, so the queries
+         *  run back to back. The savings are the round trips and responses.
+         */
+        json_add_literal(buf, "{ \"responses\": [");
+        for (i=0; i < n; i++) {
+            if (i) {
+                json_add_literal(buf, ", ");
+            } else {
+                json_add_literal(buf, " ");
             }
-            pthread_mutex_unlock(&ns->lock);
-            free_el(e);
-        }        
-        safe_free(ckey);
+            json_add_literal(buf, "{ \"namespace\": ");
+            json_add_string(buf, queries[i].namespace);
+            json_add_literal(buf, ", \"key\": ");
+            json_add_string(buf, queries[i].key ? queries[i].key : EMPTY_STRING);
+            json_add_literal(buf, ", \"results\": ");
+            results += search_namespace(&queries[i], buf);
+            if (queries[i].cursor) {
+                json_add_literal(buf, ", \"cursor\": ");
+                json_add_string(buf, queries[i].next_cursor);
+            }
+            json_add_literal(buf, " }");
+        }
+        json_add_literal(buf, " ] }\n");
         evhttp_send_reply(req, HTTP_OK, "OK", buf);
+    } else if (n < 0) {
+        evhttp_send_reply(req, HTTP_BADREQUEST, "TOO_MANY_QUERIES", buf);
     } else {
         evhttp_send_reply(req, HTTP_BADREQUEST, "MISSING_REQ_ARG", buf);
     }
-    
+
     evhttp_clear_headers(&args);
     evbuffer_free(buf);
+    log_access(req, STAT_MSEARCH, results, start);
+    enforce_budget();
 }
 
-void nuke_cb(struct evhttp_request *req, void *arg)
+
+/*
+ *  Reads and, given max_elems or policy, changes a namespace's
+ *  eviction settings. Lowering max_elems trims right away.
+ */
+void config_cb(struct evhttp_request *req, void *arg)
 {
     struct evbuffer *buf = evbuffer_new();
     struct evkeyvalq args;
+    uint64_t start = now_usec();
     struct namespace *ns;
-    composite_key *ckey;
-    char *namespace, *key, *id, *locale;
-    struct el *e, *results = NULL, *tmp = NULL;
-    
-    fprintf(stderr, "%s\n", req->uri);
+    struct el *victim;
+    char *namespace, *smax, *spolicy, *sttl, *sinfix;
+    int new, policy = -1, limit;
+
     evhttp_parse_query(req->uri, &args);
     namespace = (char *)evhttp_find_header(&args, "namespace");
-    key =       (char *)evhttp_find_header(&args, "key");
-    id =        (char *)evhttp_find_header(&args, "id");
-    locale =    (char *)evhttp_find_header(&args, "locale");
-    
-    if (namespace) {
-        ns = get_namespace(namespace);
-        ckey = make_key(locale, key, id);
-        if (ns && ckey) {
-            pthread_mutex_unlock(&ns->lock);
-            if (id) {
-                HASH_SELECT(rh, results, hh, ns->elems, key_id_match);
-            } else {
-                HASH_SELECT(rh, results, hh, ns->elems, key_match);
-            }
-            HASH_ITER(rh, results, e, tmp) {
-                HASH_DEL(ns->elems, e);  /* delete; users advances to next */
-                free_el(e);
-            }
-            HASH_CLEAR(rh, results);
-            pthread_mutex_unlock(&ns->lock);
-        }        
-        safe_free(ckey);
+    smax =      (char *)evhttp_find_header(&args, "max_elems");
+    spolicy =   (char *)evhttp_find_header(&args, "policy");
+    sttl =      (char *)evhttp_find_header(&args, "ttl");
+    sinfix =    (char *)evhttp_find_header(&args, "infix");
+
+    if (!namespace || (smax && atoi(smax) < 0) || (sttl && atoi(sttl) < 0) ||
+        (spolicy && (policy = find_policy(spolicy)) == -1)) {
+        evhttp_send_reply(req, HTTP_BADREQUEST, namespace ? "BAD_ARG" : "MISSING_REQ_ARG", buf);
+        evhttp_clear_headers(&args);
+        evbuffer_free(buf);
+        log_access(req, STAT_CONFIG, -1, start);
+        return;
+    }
+    if (!smax && !spolicy && !sttl && !sinfix && !namespace_exists(namespace)) {
+        json_add_literal(buf, "{ \"namespace\": ");
+        json_add_string(buf, namespace);
+        evbuffer_add_printf(buf, ", \"max_elems\": %d, \"policy\": \"%s\", \"ttl\": 0, \"infix\": 0 }\n",
+                            max_elems, policy_names[default_policy]);
         evhttp_send_reply(req, HTTP_OK, "OK", buf);
-    } else {
-        evhttp_send_reply(req, HTTP_BADREQUEST, "MISSING_REQ_ARG", buf);
+        evhttp_clear_headers(&args);
+        evbuffer_free(buf);
+        log_access(req, STAT_CONFIG, -1, start);
+        return;
     }
-    
+    ns = create_namespace(namespace, &new);
+    if (smax || spolicy || sttl || sinfix) {
+        if (new) {
+            bloom_remember(namespace);
+        }
+        lock_namespace(ns);
+        if (smax) {
+            ns->max_elems = atoi(smax);
+        }
+        if (sttl) {
+            /* for later puts; elements already in keep theirs */
+            ns->ttl = atoi(sttl);
+        }
+        if (sinfix) {
+            /* the index is built by the first search that needs it */
+            ns->infix = atoi(sinfix) != 0;
+            if (!ns->infix && ns->gram_elems) {
+                grams_free(ns);
+            }
+        }
+        if (policy != -1 && policy != ns->policy) {
+            ns->policy = policy;
+            heap_rebuild(ns);
+        }
+        limit = ns->max_elems ? ns->max_elems : max_elems;
+        while (ns->heap_len > limit) {
+            victim = ns->heap[0];
+            unlink_el(ns, victim);
+            free_el(victim);
+        }
+        hash_charge(ns);
+        compact_check(ns);
+        bump_version(ns);
+        ns->configured = 1;
+        if (ns->dirty++ == 0) {
+            count_add(C_DIRTIED, 1);
+        }
+        pthread_mutex_unlock(&ns->lock);
+    }
+    json_add_literal(buf, "{ \"namespace\": ");
+    json_add_string(buf, ns->name);
+    evbuffer_add_printf(buf, ", \"max_elems\": %d, \"policy\": \"%s\", \"ttl\": %d, \"infix\": %d }\n",
+                        ns->max_elems ? ns->max_elems : max_elems, policy_names[ns->policy], ns->ttl, ns->infix);
+    evhttp_send_reply(req, HTTP_OK, "OK", buf);
     evhttp_clear_headers(&args);
     evbuffer_free(buf);
+    log_access(req, STAT_CONFIG, -1, start);
+    enforce_budget();
 }
 
-void search_cb(struct evhttp_request *req, void *arg)
+void slow_cb(struct evhttp_request *req, void *arg)
+{
+    struct evbuffer *buf = evbuffer_new();
+    struct slow_entry *s;
+    uint64_t i;
+    int p;
+
+    evbuffer_add_printf(buf, "{ \"threshold_us\": %llu, \"slow\": [", (unsigned long long)slow_usec);
+    for (i=slow_count; i > 0 && i + SLOW_RING > slow_count; i--) {
+        s = &slow_ring[(i - 1) % SLOW_RING];
+        evbuffer_add_printf(buf, "%s{ \"time\": %ld, \"endpoint\": \"%s\", \"usec\": %llu, \"namespace\": ",
+                            i == slow_count ? " " : ", ", (long)s->when, stat_names[s->stat],
+                            (unsigned long long)s->usec);
+        json_add_string(buf, s->trace.namespace);
+        evbuffer_add_printf(buf, ", \"prefix_len\": %d, \"scanned\": %d, \"matches\": %d, \"results\": %d, "
+                            "\"cold_load\": %s, \"phases_us\": {", s->trace.prefix_len, s->trace.scanned,
+                            s->trace.matches, s->trace.results, s->trace.cold_load ? "true" : "false");
+        for (p=STAT_NORMALIZE; p <= STAT_LOAD; p++) {
+            evbuffer_add_printf(buf, "%s \"%s\": %u", p == STAT_NORMALIZE ? "" : ",",
+                                stat_names[p], s->trace.phases[p]);
+        }
+        json_add_literal(buf, " } }");
+    }
+    json_add_literal(buf, " ] }\n");
+    evhttp_send_reply(req, HTTP_OK, "OK", buf);
+    evbuffer_free(buf);
+}
+
+void stats_cb(struct evhttp_request *req, void *arg)
+{
+    struct evbuffer *buf = evbuffer_new();
+    struct histogram *h;
+    uint64_t count;
+    int i;
+
+    json_add_literal(buf, "{");
+    for (i=0; i < NSTATS; i++) {
+        h = &stats[i];
+        count = h->count;
+        evbuffer_add_printf(buf, "%s \"%s\": { \"count\": %llu, \"mean_us\": %llu, \"max_us\": %llu, "
+                            "\"p50_us\": %llu, \"p90_us\": %llu, \"p99_us\": %llu, \"p999_us\": %llu }",
+                            i ? "," : "", stat_names[i], (unsigned long long)count,
+                            (unsigned long long)(count ? h->sum / count : 0), (unsigned long long)h->max,
+                            (unsigned long long)hist_percentile(h, count, 0.5),
+                            (unsigned long long)hist_percentile(h, count, 0.9),
+                            (unsigned long long)hist_percentile(h, count, 0.99),
+                            (unsigned long long)hist_percentile(h, count, 0.999));
+    }
+    json_add_literal(buf, " }\n");
+    evhttp_send_reply(req, HTTP_OK, "OK", buf);
+    evbuffer_free(buf);
+}
+
+
+void prom_header(struct evbuffer *buf, const char *name, const char *type, const char *help)
+{
+    evbuffer_add_printf(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void prom_value(struct evbuffer *buf, const char *name, const char *type, const char *help, int64_t v)
+{
+    prom_header(buf, name, type, help);
+    evbuffer_add_printf(buf, "%s %lld\n", name, (long long)v);
+}
+
+/*
+ *  Re-buckets an HDR histogram onto fixed Prometheus bounds. labels is
+ *  empty or a label list without braces, e.g. endpoint="put"
+ */
+void prom_histogram(struct evbuffer *buf, const char *name, const char *labels, struct histogram *h)
+{
+    static const uint64_t bounds[] = {100, 1000, 10000, 100000, 1000000, 10000000};
+    uint64_t seen = 0, count = h->count;
+    const char *sep = *labels ? "," : "";
+    char braced[72] = "";
+    int i, b;
+
+    if (*labels) {
+        snprintf(braced, sizeof(braced), "{%s}", labels);
+    }
+    for (i=0, b=0; b < sizeof(bounds) / sizeof(bounds[0]); b++) {
+        for (; i < HIST_BUCKETS && hist_value(i) <= bounds[b]; i++) {
+            seen += h->buckets[i];
+        }
+        evbuffer_add_printf(buf, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep,
+                            bounds[b] / 1e6, (unsigned long long)seen);
+    }
+    evbuffer_add_printf(buf, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, (unsigned long long)count);
+    evbuffer_add_printf(buf, "%s_sum%s %g\n", name, braced, h->sum / 1e6);
+    evbuffer_add_printf(buf, "%s_count%s %llu\n", name, braced, (unsigned long long)count);
+}
+
+int64_t resident_bytes()
+{
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return (int64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+void metrics_cb(struct evhttp_request *req, void *arg)
+{
+    struct evbuffer *buf = evbuffer_new();
+    char labels[64];
+    int i;
+
+    prom_value(buf, "autocomplete_namespaces", "gauge", "Namespaces loaded in memory.",
+               count_sum(C_NAMESPACES));
+    prom_value(buf, "autocomplete_elements", "gauge", "Elements across all loaded namespaces.",
+               count_sum(C_ELEMS));
+    prom_value(buf, "autocomplete_element_bytes", "gauge", "Approximate heap held by elements.",
+               count_sum(C_ELEM_BYTES));
+    prom_value(buf, "process_resident_memory_bytes", "gauge", "Resident memory size in bytes.",
+               resident_bytes());
+    prom_value(buf, "autocomplete_dirty_namespaces", "gauge", "Namespaces with unflushed changes.",
+               count_sum(C_DIRTIED) - count_sum(C_FLUSHED));
+    prom_value(buf, "autocomplete_namespace_bytes", "gauge", "Heap held by loaded namespaces, counted against -m.",
+               ns_bytes);
+    prom_value(buf, "autocomplete_memory_budget_bytes", "gauge", "The -m budget, 0 if unbounded.",
+               mem_budget);
+    prom_value(buf, "autocomplete_known_namespaces", "gauge", "Names added to the on-disk existence filter.",
+               bloom_names);
+    prom_value(buf, "autocomplete_namespaces_evicted_total", "counter", "Idle namespaces dropped from memory to stay under -m.",
+               count_sum(C_NS_EVICTED));
+    prom_value(buf, "autocomplete_elements_expired_total", "counter", "Elements removed because their ttl ran out.",
+               count_sum(C_EXPIRED));
+    prom_value(buf, "autocomplete_namespaces_compacted_total", "counter", "Namespaces rebuilt to shrink their tables after deletes.",
+               count_sum(C_COMPACTED));
+
+    prom_header(buf, "autocomplete_flush_duration_seconds", "histogram", "Time per save_namespaces cycle that wrote something.");
+    prom_histogram(buf, "autocomplete_flush_duration_seconds", "", &stats[STAT_FLUSH]);
+    prom_value(buf, "autocomplete_last_flush_bytes", "gauge", "Bytes written by the last flush cycle.",
+               last_flush_bytes);
+    prom_value(buf, "autocomplete_flush_bytes_total", "counter", "Bytes written by all flushes.",
+               count_sum(C_FLUSH_BYTES));
+
+    prom_header(buf, "autocomplete_load_duration_seconds", "histogram", "Time per load_namespace that read a file; the count is cold loads.");
+    prom_histogram(buf, "autocomplete_load_duration_seconds", "", &stats[STAT_LOAD]);
+
+    prom_header(buf, "autocomplete_lock_contended_total", "counter", "Lock acquisitions that had to wait.");
+    evbuffer_add_printf(buf, "autocomplete_lock_contended_total{lock=\"master\"} %lld\n",
+                        (long long)count_sum(C_MASTER_CONTENDED));
+    evbuffer_add_printf(buf, "autocomplete_lock_contended_total{lock=\"namespace\"} %lld\n",
+                        (long long)count_sum(C_NS_CONTENDED));
+
+    prom_value(buf, "autocomplete_log_dropped_total", "counter", "Log lines dropped because the ring was full.",
+               log_dropped);
+
+    prom_header(buf, "autocomplete_request_duration_seconds", "histogram", "Request latency by endpoint.");
+    for (i=STAT_PUT; i <= STAT_CONFIG; i++) {
+        snprintf(labels, sizeof(labels), "endpoint=\"%s\"", stat_names[i]);
+        prom_histogram(buf, "autocomplete_request_duration_seconds", labels, &stats[i]);
+    }
+
+    evhttp_add_header(req->output_headers, "Content-Type", "text/plain; version=0.0.4");
+    evhttp_send_reply(req, HTTP_OK, "OK", buf);
+    evbuffer_free(buf);
+}
+
+
+void json_add_ns_memory(struct evbuffer *buf, struct namespace *ns)
+{
+    int i;
+
+    json_add_literal(buf, "{ \"namespace\": ");
+    json_add_string(buf, ns->name);
+    evbuffer_add_printf(buf, ", \"bytes\": %lld, \"elements\": %u, \"dirty\": %s, \"breakdown\": {",
+                        (long long)ns->bytes, count_els(ns), ns->dirty ? "true" : "false");
+    for (i=0; i < NMEM; i++) {
+        evbuffer_add_printf(buf, "%s \"%s\": %lld", i ? "," : "", mem_names[i], (long long)ns->mem[i]);
+    }
+    json_add_literal(buf, " } }");
+}
+
+int ns_bytes_sort(const void *a, const void *b)
+{
+    int64_t x = (*(struct namespace **)a)->bytes, y = (*(struct namespace **)b)->bytes;
+
+    return x > y ? -1 : x < y;
+}
+
+/*
+ *  Process wide breakdown plus the largest loaded namespaces, or just
+ *  the one asked for with namespace=.
+ */
+void memory_cb(struct evhttp_request *req, void *arg)
 {
     struct evbuffer *buf = evbuffer_new();
     struct evkeyvalq args;
-    composite_key *ckey;
-    char *namespace, *slimit, *locale, *ts, *id, *key;
-    struct json_object *jsobj, *jsel, *jsresults;
-    struct el *e, *results = NULL;
-    struct namespace *ns;
-    int i, new, limit = 100;
-    time_t when = 0;
-    
-    fprintf(stderr, "%s\n", req->uri);
+    struct namespace *ns, **all;
+    struct cursor *c;
+    char *namespace, *slimit;
+    int64_t cursor_bytes = 0, fixed, resident;
+    int i, n, limit = 20;
+
     evhttp_parse_query(req->uri, &args);
     namespace = (char *)evhttp_find_header(&args, "namespace");
-    key =       (char *)evhttp_find_header(&args, "key");
-    id =        (char *)evhttp_find_header(&args, "id");
-    locale =    (char *)evhttp_find_header(&args, "locale");
     slimit =    (char *)evhttp_find_header(&args, "limit");
-    ts =        (char *)evhttp_find_header(&args, "ts");
     if (slimit) {
         limit = atoi(slimit);
     }
-    if (ts) {
-        when = (time_t)strtol(ts, NULL, 10);
-    }
-    
     if (namespace) {
-        jsobj = json_object_new_object();
-        jsresults = json_object_new_array();
-        ns = create_namespace(namespace, &new);
-        ckey = make_key(locale, key, id);
-        if (ns && ckey) {
-            pthread_mutex_lock(&ns->lock);            
-            if (id) {
-                HASH_SELECT(rh, results, hh, ns->elems, key_id_match);
-            } else {
-                HASH_SELECT(rh, results, hh, ns->elems, key_match);
-            }
-            HASH_SRT(rh, results, time_count_sort);
-            for (e=results, i=0; e != NULL && i < limit && e->when > when; e=e->rh.next, i++) {
-                jsel = json_object_new_object();
-                json_object_object_add(jsel, "key", json_object_new_string(e->ckey->key));
-                json_object_object_add(jsel, "id", json_object_new_string(e->ckey->id));
-                json_object_object_add(jsel, "when", json_object_new_int(e->when));
-                json_object_object_add(jsel, "count", json_object_new_int(e->count));
-                if (e->data != NULL) {
-                    json_object_object_add(jsel, "data", json_object_new_string(e->data));
-                }
-                json_object_array_add(jsresults, jsel);
-            }
-            HASH_CLEAR(rh, results);
-            pthread_mutex_unlock(&ns->lock);
+        HASH_FIND_STR(spaces, namespace, ns);
+        if (ns) {
+            json_add_ns_memory(buf, ns);
+            json_add_literal(buf, "\n");
+            evhttp_send_reply(req, HTTP_OK, "OK", buf);
+        } else {
+            evhttp_send_reply(req, HTTP_NOTFOUND, "NOT_LOADED", buf);
         }
-        safe_free(ckey);
-        json_object_object_add(jsobj, "results", jsresults);
-        evbuffer_add_printf(buf, "%s\n", (char *)json_object_to_json_string(jsobj));
-        evhttp_send_reply(req, HTTP_OK, "OK", buf);
-        json_object_put(jsobj);
-    } else {
-        evhttp_send_reply(req, HTTP_BADREQUEST, "MISSING_REQ_ARG", buf);
+        evhttp_clear_headers(&args);
+        evbuffer_free(buf);
+        return;
     }
-    
+
+    for (c=cursors; c != NULL; c=c->hh.next) {
+        cursor_bytes += sizeof(*c) + c->nelems * sizeof(*c->elems) +
+            (c->ckey ? sizeof(*c->ckey) + KEY_LEN(c->ckey) : 0);
+    }
+    fixed = sizeof(log_ring) + sizeof(slow_ring) + sizeof(stats) + bloom_nbits / 8;
+    resident = resident_bytes();
+    json_add_literal(buf, "{ \"process\": { ");
+    evbuffer_add_printf(buf, "\"resident\": %lld, \"namespaces\": %lld, \"namespaces_breakdown\": {",
+                        (long long)resident, (long long)ns_bytes);
+    for (i=0; i < NMEM; i++) {
+        evbuffer_add_printf(buf, "%s \"%s\": %lld", i ? "," : "", mem_names[i], (long long)mem_total[i]);
+    }
+    evbuffer_add_printf(buf, " }, \"results_cache\": %lld, \"cursors\": %lld, \"fixed\": %lld, "
+                        "\"unaccounted\": %lld }, \"budget\": %lld, \"quota\": %lld, \"top\": [",
+                        (long long)results_cache_bytes, (long long)cursor_bytes, (long long)fixed,
+                        (long long)(resident - ns_bytes - results_cache_bytes - cursor_bytes - fixed),
+                        (long long)mem_budget, (long long)ns_quota);
+
+    n = HASH_COUNT(spaces);
+    all = malloc(sizeof(*all) * (n ? n : 1));
+    for (ns=spaces, i=0; ns != NULL; ns=ns->hh.next) {
+        all[i++] = ns;
+    }
+    qsort(all, n, sizeof(*all), ns_bytes_sort);
+    for (i=0; i < n && i < limit; i++) {
+        if (i) {
+            json_add_literal(buf, ", ");
+        } else {
+            json_add_literal(buf, " ");
+        }
+        json_add_ns_memory(buf, all[i]);
+    }
+    free(all);
+    json_add_literal(buf, " ] }\n");
+    evhttp_send_reply(req, HTTP_OK, "OK", buf);
     evhttp_clear_headers(&args);
     evbuffer_free(buf);
 }
 
-
 void termination_handler(int signum)
 {
     fprintf(stdout, "Shutting down...\n");
@@ -681,6 +4681,11 @@ void termination_handler(int signum)
     is_running = 0;
 }
 
+/*
+ *  bench.c includes this file to get at the internals without the
+ *  http server.
+ */
+#ifndef AUTOCOMPLETE_NO_MAIN
 int main(int argc, char **argv)
 {
     int opt;
@@ -689,7 +4694,7 @@ int main(int argc, char **argv)
     char *address = "0.0.0.0";
     UErrorCode err = U_ZERO_ERROR;
 
-    while((opt = getopt(argc, argv, "a:d:p:l:")) != -1) {
+    while((opt = getopt(argc, argv, "a:d:p:l:e:E:fc:m:q:n:L:S:T:C:")) != -1) {
         switch(opt) {
             case 'a':
                 address = optarg;
@@ -703,6 +4708,62 @@ int main(int argc, char **argv)
             case 'l':
                 default_locale = optarg;
                 break;
+            case 'e':
+                max_elems = atoi(optarg) > 0 ? atoi(optarg) : 1;
+                break;
+            case 'E':
+                if ((default_policy = find_policy(optarg)) == -1) {
+                    fprintf(stderr, "Unknown eviction policy: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'f':
+                frag_cache = 1;
+                break;
+            case 'c':
+                results_cache_max = (size_t)atoi(optarg) << 20;
+                break;
+            case 'm':
+                mem_budget = (int64_t)atoi(optarg) << 20;
+                break;
+            case 'q':
+                ns_quota = (int64_t)atoi(optarg) << 10;
+                break;
+            case 'n':
+                for (normalize=0; normalize < NNORMS; normalize++) {
+                    if (strcmp(optarg, norm_names[normalize]) == 0) {
+                        break;
+                    }
+                }
+                if (normalize == NNORMS) {
+                    fprintf(stderr, "Unknown normalization: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'L':
+                for (log_level=LOG_DEBUG; log_level >= LOG_ERROR; log_level--) {
+                    if (strcmp(optarg, log_levels[log_level]) == 0) {
+                        break;
+                    }
+                }
+                if (log_level < LOG_ERROR) {
+                    fprintf(stderr, "Unknown log level: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'S':
+                log_sample = atoi(optarg) > 0 ? atoi(optarg) : 1;
+                break;
+            case 'T':
+                slow_usec = strtod(optarg, NULL) * 1000;
+                break;
+            case 'C':
+                capture_fd = open(optarg, O_WRONLY|O_CREAT|O_APPEND, 0660);
+                if (capture_fd == -1) {
+                    fprintf(stderr, "Could not open capture file: %s: %s\n", optarg, strerror(errno));
+                    return 1;
+                }
+                break;
             case '?':
                 fprintf (stderr, "Unknown option: '-%c'\n", optopt);
                 return 1;
@@ -714,6 +4775,7 @@ int main(int argc, char **argv)
     signal(SIGTERM, termination_handler);
     signal(SIGPIPE, SIG_IGN);
 
+    srandom(time(NULL) ^ getpid());
     pthread_mutex_init(&master_lock, NULL);
     pthread_cond_init(&backup_cond, NULL);
     uloc_setDefault(default_locale, &err);
@@ -722,16 +4784,25 @@ int main(int argc, char **argv)
         exit(1);
     }
 
+    if (mem_budget && !db_dir) {
+        fprintf(stderr, "-m needs -d, evicted namespaces are reloaded from disk\n");
+        return 1;
+    }
+    log_start();
     if (db_dir) {
         if (db_dir[strlen(db_dir)] == '/') {
             db_dir[strlen(db_dir)] = '\0';
         }
         make_nested_dirs();
+        upgrade_namespaces();
+        bloom_build();
     }
     event_init();
     pthread_create(&id, NULL, backup_thread, NULL);
     pthread_detach(id);
     backup(0,0,NULL);
+    expire_tick(0,0,NULL);
+    compact_tick(0,0,NULL);
 
     httpd = evhttp_start(address, port);
     if (httpd == NULL) {
@@ -743,10 +4814,18 @@ int main(int argc, char **argv)
     evhttp_set_cb(httpd, "/del", del_cb, NULL);
     evhttp_set_cb(httpd, "/nuke", nuke_cb, NULL);
     evhttp_set_cb(httpd, "/search", search_cb, NULL);
+    evhttp_set_cb(httpd, "/msearch", msearch_cb, NULL);
+    evhttp_set_cb(httpd, "/stats", stats_cb, NULL);
+    evhttp_set_cb(httpd, "/metrics", metrics_cb, NULL);
+    evhttp_set_cb(httpd, "/debug/slow", slow_cb, NULL);
+    evhttp_set_cb(httpd, "/debug/memory", memory_cb, NULL);
+    evhttp_set_cb(httpd, "/config", config_cb, NULL);
     fprintf(stdout, "Starting %s (%s) listening on: %s:%d\n", NAME, VERSION, address, port);
 
     event_dispatch();
     evhttp_free(httpd);
     save_namespaces();
+    log_stop();
     return 0;
 }
+#endif
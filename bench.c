@@ -0,0 +1,470 @@
+/*
+ *  Microbenchmarks for the core data path, without the http layer.
+ *
+ *    make bench && ./bench [filter]
+ *    ./bench -P [-n namespaces] [-e elements] [-s data bytes] [-d dir]
+ *
+ *  -P benchmarks persistence instead: it writes a db directory in the
+ *  namespace_path() layout through save_namespaces(), loads it back
+ *  namespace by namespace, then times a server starting on it until
+ *  it accepts connections. Files are read back from the page cache.
+ *
+ *  Allocations are counted for this code and uthash, not for libicu
+ *  or libevent internals.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static uint64_t nallocs = 0;
+
+static void *bench_malloc(size_t n)
+{
+    nallocs++;
+    return malloc(n);
+}
+
+static void *bench_realloc(void *p, size_t n)
+{
+    nallocs++;
+    return realloc(p, n);
+}
+
+static char *bench_strdup(const char *s)
+{
+    nallocs++;
+    return strdup(s);
+}
+
+#define malloc(n) bench_malloc(n)
+#define realloc(p, n) bench_realloc(p, n)
+#define strdup(s) bench_strdup(s)
+
+#define AUTOCOMPLETE_NO_MAIN
+#include "autocomplete.c"
+
+#define BENCH_SECONDS 0.2
+
+typedef void (*bench_fn)(void *ctx, int i);
+
+char *filter = NULL;
+
+/*
+ *  Runs fn until BENCH_SECONDS have passed and prints ns/op and
+ *  allocs/op.
+ */
+void bench(const char *name, bench_fn fn, void *ctx)
+{
+    uint64_t start, elapsed, allocs;
+    int i, n, total = 0;
+
+    if (filter && !strstr(name, filter)) {
+        return;
+    }
+    allocs = nallocs;
+    start = now_usec();
+    for (n=1; ; n *= 2) {
+        for (i=0; i < n; i++) {
+            fn(ctx, total + i);
+        }
+        total += n;
+        elapsed = now_usec() - start;
+        if (elapsed >= BENCH_SECONDS * 1000000) {
+            break;
+        }
+    }
+    printf("%-40s %12.1f ns/op %8.2f allocs/op %10d ops\n", name,
+           elapsed * 1000.0 / total, (double)(nallocs - allocs) / total, total);
+}
+
+/*
+ *  Deterministic, distinct keys: each octal digit of a scrambled i
+ *  picks a syllable, or for non-ascii keys sometimes a lowercase
+ *  accented latin, greek, cyrillic or cjk character instead.
+ */
+char *make_word(char *buf, int i, int ascii)
+{
+    static const char *syllables[] = {"ka", "to", "ri", "ne", "su", "mo", "la", "pe"};
+    static const char *wide[] = {"\xc3\xa9", "\xce\xbb", "\xd0\xb6", "\xe6\x9d\xb1", "\xc3\xbc", "\xc3\xb1"};
+    uint32_t h = i * 2654435761u;
+    int d, shift, n = 0;
+
+    for (shift=29; shift >= 0; shift -= 3) {
+        d = (h >> shift) & 7;
+        if (ascii || d >= 6) {
+            n += sprintf(buf + n, "%s", syllables[d]);
+        } else {
+            n += sprintf(buf + n, "%s", wide[d]);
+        }
+    }
+    buf[n] = '\0';
+    return buf;
+}
+
+/*
+ *  Cuts s after n characters.
+ */
+void truncate_chars(char *s, int n)
+{
+    for (; *s && n > 0; n--) {
+        s++;
+        while ((*s & 0xc0) == 0x80) {
+            s++;
+        }
+    }
+    *s = '\0';
+}
+
+void drop_namespace(char *name)
+{
+    struct namespace *ns;
+
+    HASH_FIND_STR(spaces, name, ns);
+    if (ns) {
+        ns->dirty = 0;
+        evict_namespace(ns);
+    }
+}
+
+void fill_namespace(char *name, int nelems, int ascii)
+{
+    char key[64];
+    int i;
+
+    drop_namespace(name);
+    for (i=0; i < nelems; i++) {
+        put_el(name, NULL, make_word(key, i, ascii), NULL, "data", 1000 + i, 0, 0);
+    }
+}
+
+struct key_ctx {
+    char keys[64][64];
+};
+
+void bench_make_key(void *ctx, int i)
+{
+    struct key_ctx *k = ctx;
+
+    free(make_key(NULL, k->keys[i % 64], "id"));
+}
+
+void bench_tolower(void *ctx, int i)
+{
+    struct key_ctx *k = ctx;
+
+    free(utf8_tolower(k->keys[i % 64], NULL));
+}
+
+void bench_fold(void *ctx, int i)
+{
+    struct key_ctx *k = ctx;
+
+    free(utf8_fold(k->keys[i % 64], NULL));
+}
+
+struct put_ctx {
+    char name[32];
+    int ascii;
+};
+
+void bench_put_new(void *ctx, int i)
+{
+    struct put_ctx *p = ctx;
+    char key[64];
+
+    put_el(p->name, NULL, make_word(key, i, p->ascii), NULL, "data", i, 0, 0);
+}
+
+void bench_put_existing(void *ctx, int i)
+{
+    struct put_ctx *p = ctx;
+    char key[64];
+
+    put_el(p->name, NULL, make_word(key, i % 1000, p->ascii), NULL, "data", i, 0, 0);
+}
+
+struct search_ctx {
+    struct query q;
+    char prefix[64];
+    struct evbuffer *buf;
+};
+
+void bench_search(void *ctx, int i)
+{
+    struct search_ctx *s = ctx;
+
+    search_namespace(&s->q, s->buf);
+    evbuffer_drain(s->buf, evbuffer_get_length(s->buf));
+}
+
+void bench_save(void *ctx, int i)
+{
+    struct namespace *ns = get_namespace(ctx);
+
+    ns->dirty = 1;
+    save_namespace(ns);
+}
+
+void bench_load(void *ctx, int i)
+{
+    int new;
+
+    drop_namespace(ctx);
+    create_namespace(ctx, &new);
+}
+
+/*
+ *  Creates only the two directories namespace_path() needs, rather
+ *  than all 65536 from make_nested_dirs().
+ */
+void make_namespace_dir(char *name)
+{
+    UT_string *path;
+    char *slash;
+
+    utstring_new(path);
+    namespace_path(path, name);
+    slash = strrchr(utstring_body(path), '/');
+    *slash = '\0';
+    slash = strrchr(utstring_body(path), '/');
+    *slash = '\0';
+    mkdir(utstring_body(path), 0770);
+    *slash = '/';
+    mkdir(utstring_body(path), 0770);
+    utstring_free(path);
+}
+
+/*
+ *  Forks the server on db_dir and polls until it accepts a connection.
+ *  Returns usec from fork, or 0 if it never came up.
+ */
+uint64_t time_to_ready(int port)
+{
+    struct sockaddr_in sin;
+    char portstr[16];
+    uint64_t start, ready = 0;
+    pid_t pid;
+    int fd, i;
+
+    snprintf(portstr, sizeof(portstr), "%d", port);
+    start = now_usec();
+    pid = fork();
+    if (pid == 0) {
+        fd = open("/dev/null", O_WRONLY);
+        dup2(fd, 1);
+        dup2(fd, 2);
+        execl("./autocomplete", "autocomplete", "-d", db_dir, "-p", portstr, "-L", "error", NULL);
+        _exit(127);
+    }
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (i=0; i < 30000 && !ready; i++) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0) {
+            ready = now_usec() - start;
+        } else if (waitpid(pid, NULL, WNOHANG) == pid) {
+            close(fd);
+            return 0;
+        } else {
+            usleep(1000);
+        }
+        close(fd);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return ready;
+}
+
+void persist_bench(int nspaces, int nelems, int data_size, int port)
+{
+    struct namespace *ns, *tmp;
+    char name[32], key[64], *data;
+    uint64_t start, usec, elems = 0;
+    size_t bytes;
+    int i, j, new;
+
+    data = malloc(data_size + 1);
+    memset(data, 'x', data_size);
+    data[data_size] = '\0';
+
+    start = now_usec();
+    make_nested_dirs();
+    printf("make_nested_dirs           %10.1f ms\n", (now_usec() - start) / 1000.0);
+
+    for (i=0; i < nspaces; i++) {
+        snprintf(name, sizeof(name), "user%d", i);
+        for (j=0; j < nelems; j++) {
+            put_el(name, NULL, make_word(key, i * nelems + j, 1), NULL, data, 1000 + j, 0, 1);
+        }
+    }
+    start = now_usec();
+    save_namespaces();
+    usec = now_usec() - start;
+    bytes = last_flush_bytes;
+    printf("save_namespaces            %10.1f ms %10.1f MB %8.1f MB/s %10.0f spaces/s\n", usec / 1000.0,
+           bytes / 1048576.0, bytes / 1048576.0 / (usec / 1e6), nspaces / (usec / 1e6));
+
+    HASH_ITER(hh, spaces, ns, tmp) {
+        drop_namespace(ns->name);
+    }
+    start = now_usec();
+    for (i=0; i < nspaces; i++) {
+        snprintf(name, sizeof(name), "user%d", i);
+        ns = create_namespace(name, &new);
+        elems += HASH_COUNT(ns->elems);
+    }
+    usec = now_usec() - start;
+    printf("load_namespace             %10.1f ms %10.1f MB %8.1f MB/s %10.0f spaces/s %10.0f elems/s\n",
+           usec / 1000.0, bytes / 1048576.0, bytes / 1048576.0 / (usec / 1e6), nspaces / (usec / 1e6),
+           elems / (usec / 1e6));
+    if (elems != (uint64_t)nspaces * nelems) {
+        printf("loaded %llu elements, expected %llu\n", (unsigned long long)elems,
+               (unsigned long long)nspaces * nelems);
+    }
+
+    usec = time_to_ready(port);
+    if (usec) {
+        printf("server time to ready       %10.1f ms\n", usec / 1000.0);
+    } else {
+        printf("server time to ready       failed, is ./autocomplete built and port %d free?\n", port);
+    }
+    free(data);
+}
+
+int main(int argc, char **argv)
+{
+    static const int sizes[] = {100, 1000, 10000};
+    static const int prefixes[] = {0, 1, 3};
+    struct key_ctx keys;
+    struct put_ctx put;
+    struct search_ctx search;
+    char name[64], tmpl[] = "/tmp/autocomplete-bench-XXXXXX";
+    int i, j, ascii, opt, persist = 0;
+    int nspaces = 1000, nelems = 100, data_size = 32, port = 18080;
+
+    while ((opt = getopt(argc, argv, "Pn:e:s:d:p:")) != -1) {
+        switch (opt) {
+            case 'P':
+                persist = 1;
+                break;
+            case 'n':
+                nspaces = atoi(optarg);
+                break;
+            case 'e':
+                nelems = atoi(optarg);
+                break;
+            case 's':
+                data_size = atoi(optarg);
+                break;
+            case 'd':
+                db_dir = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: bench [filter] | bench -P [-n namespaces] [-e elements] "
+                                "[-s data bytes] [-d dir] [-p port]\n");
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        filter = argv[optind];
+    }
+    log_level = LOG_ERROR;
+    results_cache_max = 0;
+    max_elems = 1 << 30;
+    uloc_setDefault(default_locale, &(UErrorCode){U_ZERO_ERROR});
+
+    if (persist) {
+        if (!db_dir) {
+            if (!mkdtemp(tmpl)) {
+                perror("mkdtemp");
+                return 1;
+            }
+            db_dir = tmpl;
+        } else if (mkdir(db_dir, 0770) != 0 && errno != EEXIST) {
+            perror(db_dir);
+            return 1;
+        }
+        persist_bench(nspaces, nelems, data_size, port);
+        printf("db directory left in %s\n", db_dir);
+        return 0;
+    }
+
+    for (ascii=1; ascii >= 0; ascii--) {
+        for (i=0; i < 64; i++) {
+            make_word(keys.keys[i], i, ascii);
+        }
+        snprintf(name, sizeof(name), "make_key/%s", ascii ? "ascii" : "utf8");
+        bench(name, bench_make_key, &keys);
+        snprintf(name, sizeof(name), "utf8_tolower/%s", ascii ? "ascii" : "utf8");
+        bench(name, bench_tolower, &keys);
+        normalize = NORM_FOLD;
+        snprintf(name, sizeof(name), "make_key/fold/%s", ascii ? "ascii" : "utf8");
+        bench(name, bench_make_key, &keys);
+        normalize = NORM_LOWER;
+        snprintf(name, sizeof(name), "utf8_fold/%s", ascii ? "ascii" : "utf8");
+        bench(name, bench_fold, &keys);
+    }
+
+    for (ascii=1; ascii >= 0; ascii--) {
+        put.ascii = ascii;
+        snprintf(put.name, sizeof(put.name), "put-new-%d", ascii);
+        snprintf(name, sizeof(name), "put_el/new/%s", ascii ? "ascii" : "utf8");
+        bench(name, bench_put_new, &put);
+        drop_namespace(put.name);
+        snprintf(put.name, sizeof(put.name), "put-existing-%d", ascii);
+        fill_namespace(put.name, 1000, ascii);
+        snprintf(name, sizeof(name), "put_el/existing/%s", ascii ? "ascii" : "utf8");
+        bench(name, bench_put_existing, &put);
+        drop_namespace(put.name);
+    }
+
+    memset(&search, 0, sizeof(search));
+    search.buf = evbuffer_new();
+    search.q.limit = DEFAULT_LIMIT;
+    for (i=0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (ascii=1; ascii >= 0; ascii--) {
+            snprintf(put.name, sizeof(put.name), "search-%d-%d", sizes[i], ascii);
+            fill_namespace(put.name, sizes[i], ascii);
+            search.q.namespace = put.name;
+            for (j=0; j < sizeof(prefixes) / sizeof(prefixes[0]); j++) {
+                make_word(search.prefix, 7, ascii);
+                truncate_chars(search.prefix, prefixes[j]);
+                search.q.key = search.prefix;
+                snprintf(name, sizeof(name), "search/n=%d/prefix=%d/%s", sizes[i], prefixes[j],
+                         ascii ? "ascii" : "utf8");
+                bench(name, bench_search, &search);
+            }
+            drop_namespace(put.name);
+        }
+    }
+    evbuffer_free(search.buf);
+
+    if (!mkdtemp(tmpl)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    db_dir = tmpl;
+    for (i=0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        snprintf(put.name, sizeof(put.name), "persist-%d", sizes[i]);
+        make_namespace_dir(put.name);
+        fill_namespace(put.name, sizes[i], 1);
+        snprintf(name, sizeof(name), "save_namespace/n=%d", sizes[i]);
+        bench(name, bench_save, put.name);
+        snprintf(name, sizeof(name), "load_namespace/n=%d", sizes[i]);
+        bench(name, bench_load, put.name);
+        drop_namespace(put.name);
+    }
+    printf("scratch files left in %s\n", tmpl);
+    return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ *  Prints fold.h, the code point tables behind -n fold:
+ *
+ *    make -B fold.h
+ *
+ *  Each entry is what utf8_fold() makes of the code point, so the
+ *  tables and ICU always agree: the single code point it becomes, 0
+ *  when it goes away, or FOLD_ICU when it becomes more than one or
+ *  depends on what is around it, like a final sigma or a Hangul
+ *  vowel joining the syllable before it. Rerun it after an ICU
+ *  upgrade.
+ */
+#define AUTOCOMPLETE_NO_MAIN
+#include "autocomplete.c"
+
+struct {
+    UChar32 lo, hi;
+    const char *name;
+} ranges[] = {
+    {0x0080, 0x0530, "Latin-1, Latin extended, IPA, Greek and Cyrillic"},
+    {0x1e00, 0x2000, "Latin and Greek extended"},
+    {0x3040, 0x3100, "hiragana and katakana"},
+    {0x4e00, 0xa000, "CJK unified ideographs"},
+    {0xac00, 0xd7a4, "Hangul syllables"},
+    {0xff00, 0xfff0, "halfwidth and fullwidth forms"}
+};
+
+#define NRANGES (sizeof(ranges) / sizeof(ranges[0]))
+
+uint16_t *entries[NRANGES];
+
+/*
+ *  True if folding s with "a" before, after and around it is the same
+ *  as folding it on its own.
+ */
+int context_free(char *s, char *folded)
+{
+    char in[16], want[16], *out;
+    int ok = 1, i;
+
+    for (i=0; i < 3; i++) {
+        snprintf(in, sizeof(in), "%s%s%s", i != 1 ? "a" : "", s, i != 0 ? "a" : "");
+        snprintf(want, sizeof(want), "%s%s%s", i != 1 ? "a" : "", folded, i != 0 ? "a" : "");
+        out = utf8_fold(in, "en");
+        ok = ok && out && strcmp(out, want) == 0;
+        safe_free(out);
+    }
+    return ok;
+}
+
+uint16_t fold_entry(UChar32 c)
+{
+    char in[8], *out;
+    int n = 0, len;
+    UChar32 m = 0;
+    UErrorCode err = U_ZERO_ERROR;
+    uint16_t entry = FOLD_ICU;
+
+    if (U_IS_SURROGATE(c)) {
+        return FOLD_ICU;
+    }
+    U8_APPEND_UNSAFE(in, n, c);
+    in[n] = '\0';
+    if (!(out = utf8_fold(in, "en"))) {
+        return FOLD_ICU;
+    }
+    len = strlen(out);
+    n = 0;
+    if (len) {
+        U8_NEXT(out, n, len, m);
+    }
+    if (n == len && m >= 0 && m < FOLD_ICU && context_free(in, out) &&
+        (!m || unorm2_hasBoundaryBefore(unorm2_getNFCInstance(&err), m))) {
+        entry = m;
+    }
+    free(out);
+    return entry;
+}
+
+/*
+ *  A range where every code point stays as it is gets no table.
+ */
+int identity(int i)
+{
+    UChar32 c;
+
+    for (c=ranges[i].lo; c < ranges[i].hi; c++) {
+        if (entries[i][c - ranges[i].lo] != c) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    int i, j;
+
+    for (i=0; i < NRANGES; i++) {
+        entries[i] = malloc((ranges[i].hi - ranges[i].lo) * sizeof(**entries));
+        for (j=ranges[i].lo; j < ranges[i].hi; j++) {
+            entries[i][j - ranges[i].lo] = fold_entry(j);
+        }
+    }
+
+    printf("/*\n"
+           " *  Generated by fold_gen.c from ICU %s, see table_fold().\n"
+           " */\n"
+           "struct fold_range {\n"
+           "    int32_t lo, hi;\n"
+           "    const uint16_t *map;\n"
+           "};\n"
+           "\n"
+           "#define FOLD_ICU 0xffff\n", U_ICU_VERSION);
+    for (i=0; i < NRANGES; i++) {
+        if (identity(i)) {
+            continue;
+        }
+        printf("\n/* %s */\nstatic const uint16_t fold_%04x[] = {", ranges[i].name, ranges[i].lo);
+        for (j=ranges[i].lo; j < ranges[i].hi; j++) {
+            printf("%s0x%04x%s", (j - ranges[i].lo) % 8 ? " " : "\n    ", entries[i][j - ranges[i].lo],
+                   j + 1 < ranges[i].hi ? "," : "\n");
+        }
+        printf("};\n");
+    }
+    printf("\n/* a NULL map leaves the range as it is */\n"
+           "static const struct fold_range fold_ranges[] = {\n");
+    for (i=0; i < NRANGES; i++) {
+        if (identity(i)) {
+            printf("    {0x%04x, 0x%04x, NULL},\n", ranges[i].lo, ranges[i].hi);
+        } else {
+            printf("    {0x%04x, 0x%04x, fold_%04x},\n", ranges[i].lo, ranges[i].hi, ranges[i].lo);
+        }
+    }
+    printf("    {0, 0, NULL}\n};\n");
+    return 0;
+}
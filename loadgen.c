@@ -0,0 +1,688 @@
+/*
+ *  Load generator for autocomplete.
+ *
+ *    make loadgen && ./loadgen -c 16 -t 30 -n 10000 -w 0.05
+ *
+ *  Each worker thread holds one keep-alive connection. A worker picks
+ *  a namespace from a zipf distribution, then either puts a word or
+ *  types one: a search for every prefix of the word, one keystroke at
+ *  a time, the way a search box does. Words are also zipf distributed
+ *  so popular prefixes are shared across namespaces.
+ *
+ *  With -r it instead replays a file captured by autocomplete -C,
+ *  keeping the original spacing between requests divided by -x. -o
+ *  saves the latency histograms and -b compares against saved ones,
+ *  so two builds can be run over the same capture and diffed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (40 * HIST_SUB)
+#define MAX_WORD 64
+
+enum {
+    OP_SEARCH,
+    OP_MSEARCH,
+    OP_PUT,
+    OP_DEL,
+    OP_NUKE,
+    OP_OTHER,
+    NOPS
+};
+
+const char *op_names[NOPS] = {"search", "msearch", "put", "del", "nuke", "other"};
+
+char *host = "127.0.0.1";
+char *port = "8080";
+int concurrency = 8;
+int duration = 10;
+int nnamespaces = 1000;
+int nwords = 10000;
+double skew = 1.0;
+double write_frac = 0.1;
+int limit = 10;
+volatile int stopping = 0;
+char *replay_file = NULL;
+double speed = 1.0;
+char *out_file = NULL;
+char *baseline_file = NULL;
+
+struct zipf {
+    int n;
+    double *cdf;
+};
+
+struct zipf ns_dist, word_dist;
+char (*words)[MAX_WORD];
+
+/*
+ *  Captured requests, at is usec after the first one.
+ */
+struct replay {
+    uint64_t at;
+    char *uri;
+};
+
+struct replay *replay = NULL;
+int nreplay = 0;
+int replay_pos = 0;
+uint64_t replay_start;
+
+/*
+ *  Latency histogram with 8 linear sub buckets per power of two,
+ *  the same layout /stats uses.
+ */
+struct histogram {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+struct worker {
+    pthread_t thread;
+    int fd;
+    uint64_t seed;
+    char *buf;
+    size_t bufsize;
+    uint64_t errors;
+    uint64_t bytes;
+    struct histogram hist[NOPS];
+};
+
+uint64_t now_usec()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int hist_bucket(uint64_t v)
+{
+    int msb, shift, i;
+
+    if (v < HIST_SUB) {
+        return v;
+    }
+    msb = 63 - __builtin_clzll(v);
+    shift = msb - HIST_SUB_BITS;
+    i = (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+/*
+ *  Largest value that lands in bucket i.
+ */
+uint64_t hist_value(int i)
+{
+    int shift;
+
+    if (i < HIST_SUB) {
+        return i;
+    }
+    shift = i / HIST_SUB - 1;
+    return ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+}
+
+void hist_record(struct histogram *h, uint64_t v)
+{
+    h->buckets[hist_bucket(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+void hist_merge(struct histogram *into, struct histogram *from)
+{
+    int i;
+
+    for (i=0; i < HIST_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+uint64_t hist_percentile(struct histogram *h, double p)
+{
+    uint64_t seen = 0, want = ceil(h->count * p);
+    int i;
+
+    for (i=0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want && seen > 0) {
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+        }
+    }
+    return h->max;
+}
+
+/*
+ *  xorshift64*, one state per worker.
+ */
+uint64_t next_rand(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+
+double next_double(uint64_t *s)
+{
+    return (next_rand(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void zipf_init(struct zipf *z, int n, double s)
+{
+    double sum = 0;
+    int i;
+
+    z->n = n;
+    z->cdf = malloc(n * sizeof(double));
+    for (i=0; i < n; i++) {
+        sum += 1.0 / pow(i + 1, s);
+        z->cdf[i] = sum;
+    }
+    for (i=0; i < n; i++) {
+        z->cdf[i] /= sum;
+    }
+}
+
+/*
+ *  Returns a rank in [0, n), 0 being the most popular.
+ */
+int zipf_next(struct zipf *z, uint64_t *seed)
+{
+    double u = next_double(seed);
+    int lo = 0, hi = z->n - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (z->cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ *  Pronounceable words of 2 to 6 syllables. Collisions are harmless,
+ *  they only make some words more popular.
+ */
+void make_words(int n)
+{
+    static const char *syllables[] = {"ka", "to", "ri", "ne", "su", "mo", "la", "pe",
+                                      "bar", "cho", "din", "fel", "gro", "han", "jus", "ver"};
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    int i, j, len, off;
+
+    words = malloc(n * sizeof(*words));
+    for (i=0; i < n; i++) {
+        len = 2 + next_rand(&seed) % 5;
+        for (off=0, j=0; j < len; j++) {
+            off += sprintf(words[i] + off, "%s", syllables[next_rand(&seed) % 16]);
+        }
+    }
+}
+
+int conn_open()
+{
+    struct addrinfo hints, *res, *ai;
+    int fd = -1, one = 1, rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    rc = getaddrinfo(host, port, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo %s:%s: %s\n", host, port, gai_strerror(rc));
+        return -1;
+    }
+    for (ai=res; ai != NULL; ai=ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/*
+ *  Sends one GET and reads the whole response. Returns the status
+ *  code, or -1 with the connection closed.
+ */
+int do_request(struct worker *w, const char *uri)
+{
+    char req[4096], *hdr_end, *p;
+    size_t have = 0, need;
+    ssize_t n;
+    int len, status, keepalive = 1;
+
+    if (w->fd == -1) {
+        w->fd = conn_open();
+        if (w->fd == -1) {
+            return -1;
+        }
+    }
+    len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", uri, host);
+    if (len >= sizeof(req) || write(w->fd, req, len) != len) {
+        goto fail;
+    }
+    for (;;) {
+        if (have + 1 >= w->bufsize) {
+            w->bufsize *= 2;
+            w->buf = realloc(w->buf, w->bufsize);
+        }
+        n = read(w->fd, w->buf + have, w->bufsize - have - 1);
+        if (n <= 0) {
+            goto fail;
+        }
+        have += n;
+        w->buf[have] = '\0';
+        hdr_end = strstr(w->buf, "\r\n\r\n");
+        if (hdr_end) {
+            break;
+        }
+    }
+    if (sscanf(w->buf, "HTTP/1.%*d %d", &status) != 1) {
+        goto fail;
+    }
+    need = 0;
+    for (p=strstr(w->buf, "\r\n"); p && p < hdr_end; p=strstr(p + 2, "\r\n")) {
+        if (strncasecmp(p + 2, "Content-Length:", 15) == 0) {
+            need = strtoul(p + 17, NULL, 10);
+        } else if (strncasecmp(p + 2, "Connection: close", 17) == 0) {
+            keepalive = 0;
+        }
+    }
+    need += hdr_end + 4 - w->buf;
+    while (have < need) {
+        if (need + 1 > w->bufsize) {
+            w->bufsize = need + 1;
+            w->buf = realloc(w->buf, w->bufsize);
+        }
+        n = read(w->fd, w->buf + have, need - have);
+        if (n <= 0) {
+            goto fail;
+        }
+        have += n;
+    }
+    w->bytes += have;
+    if (!keepalive) {
+        close(w->fd);
+        w->fd = -1;
+    }
+    return status;
+
+fail:
+    close(w->fd);
+    w->fd = -1;
+    return -1;
+}
+
+/*
+ *  start is passed in so replays can measure from when a request was
+ *  due rather than when a worker got to it. Replayed traffic may
+ *  include client errors, so only 5xx and failed connections count as
+ *  errors.
+ */
+void timed_request(struct worker *w, int op, const char *uri, uint64_t start)
+{
+    int status;
+
+    status = do_request(w, uri);
+    if (status == -1 || status >= 500) {
+        w->errors++;
+        return;
+    }
+    hist_record(&w->hist[op], now_usec() - start);
+}
+
+void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    char uri[512], *word;
+    int ns, len, i;
+
+    while (!stopping) {
+        ns = zipf_next(&ns_dist, &w->seed);
+        word = words[zipf_next(&word_dist, &w->seed)];
+        if (next_double(&w->seed) < write_frac) {
+            snprintf(uri, sizeof(uri), "/put?namespace=ns%d&key=%s&data=%s", ns, word, word);
+            timed_request(w, OP_PUT, uri, now_usec());
+            continue;
+        }
+        len = strlen(word);
+        for (i=1; i <= len && !stopping; i++) {
+            snprintf(uri, sizeof(uri), "/search?namespace=ns%d&key=%.*s&limit=%d", ns, i, word, limit);
+            timed_request(w, OP_SEARCH, uri, now_usec());
+        }
+    }
+    return NULL;
+}
+
+int uri_op(const char *uri)
+{
+    static const char *paths[] = {"/search?", "/msearch?", "/put?", "/del?", "/nuke?"};
+    int op;
+
+    for (op=0; op < OP_OTHER; op++) {
+        if (strncmp(uri, paths[op], strlen(paths[op])) == 0) {
+            return op;
+        }
+    }
+    return OP_OTHER;
+}
+
+/*
+ *  Reads "<usec> <uri>" lines as written by autocomplete -C.
+ */
+int load_replay(char *path)
+{
+    FILE *fp;
+    char *line = NULL, *uri;
+    size_t cap = 0;
+    ssize_t len;
+    uint64_t at, first = 0;
+    int size = 0;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+        at = strtoull(line, &uri, 10);
+        if (*uri != ' ' || uri[1] != '/') {
+            continue;
+        }
+        if (nreplay == 0) {
+            first = at;
+        }
+        if (nreplay == size) {
+            size = size ? size * 2 : 4096;
+            replay = realloc(replay, size * sizeof(*replay));
+        }
+        replay[nreplay].at = at > first ? at - first : 0;
+        replay[nreplay].uri = strdup(uri + 1);
+        nreplay++;
+    }
+    free(line);
+    fclose(fp);
+    return nreplay;
+}
+
+/*
+ *  Workers take captured requests in order and sleep until each one
+ *  is due. -x 0 sends them back to back.
+ */
+void *replay_thread(void *arg)
+{
+    struct worker *w = arg;
+    uint64_t due, now;
+    int i;
+
+    while (!stopping && (i = __sync_fetch_and_add(&replay_pos, 1)) < nreplay) {
+        now = now_usec();
+        due = now;
+        if (speed > 0) {
+            due = replay_start + replay[i].at / speed;
+            if (due > now) {
+                usleep(due - now);
+            }
+        }
+        timed_request(w, uri_op(replay[i].uri), replay[i].uri, due);
+    }
+    return NULL;
+}
+
+/*
+ *  One line per op: name, count, sum, max, then bucket:count pairs
+ *  for the non-empty buckets.
+ */
+void save_histograms(char *path, struct histogram *hist)
+{
+    FILE *fp;
+    int op, i;
+
+    fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+        return;
+    }
+    for (op=0; op < NOPS; op++) {
+        fprintf(fp, "%s %llu %llu %llu", op_names[op], (unsigned long long)hist[op].count,
+                (unsigned long long)hist[op].sum, (unsigned long long)hist[op].max);
+        for (i=0; i < HIST_BUCKETS; i++) {
+            if (hist[op].buckets[i]) {
+                fprintf(fp, " %d:%llu", i, (unsigned long long)hist[op].buckets[i]);
+            }
+        }
+        fprintf(fp, "\n");
+    }
+    fclose(fp);
+}
+
+int load_histograms(char *path, struct histogram *hist)
+{
+    FILE *fp;
+    char name[32];
+    unsigned long long count, sum, max, n;
+    int op, i, c;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    memset(hist, 0, NOPS * sizeof(*hist));
+    while (fscanf(fp, "%31s %llu %llu %llu", name, &count, &sum, &max) == 4) {
+        for (op=0; op < NOPS && strcmp(name, op_names[op]) != 0; op++);
+        while ((c = fgetc(fp)) == ' ' && fscanf(fp, "%d:%llu", &i, &n) == 2) {
+            if (op < NOPS && i >= 0 && i < HIST_BUCKETS) {
+                hist[op].buckets[i] = n;
+            }
+        }
+        if (op < NOPS) {
+            hist[op].count = count;
+            hist[op].sum = sum;
+            hist[op].max = max;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+void compare(struct histogram *base, struct histogram *hist)
+{
+    static const double ps[] = {0.5, 0.99, 0.999};
+    static const char *pnames[] = {"p50", "p99", "p999"};
+    uint64_t a, b;
+    int op, i;
+
+    printf("\n%-8s %6s %10s %10s %8s\n", "op", "", "baseline", "this run", "change");
+    for (op=0; op < NOPS; op++) {
+        if (hist[op].count == 0 || base[op].count == 0) {
+            continue;
+        }
+        for (i=0; i < 3; i++) {
+            a = hist_percentile(&base[op], ps[i]);
+            b = hist_percentile(&hist[op], ps[i]);
+            printf("%-8s %6s %8lluus %8lluus %+7.1f%%\n", i ? "" : op_names[op], pnames[i],
+                   (unsigned long long)a, (unsigned long long)b, a ? (b - (double)a) * 100 / a : 0);
+        }
+    }
+}
+
+void report(struct histogram *hist, uint64_t errors, uint64_t bytes, double secs)
+{
+    uint64_t total = 0;
+    int op;
+
+    for (op=0; op < NOPS; op++) {
+        total += hist[op].count;
+    }
+    printf("%llu requests in %.2fs, %.0f req/s, %.2f MB/s, %llu errors\n",
+           (unsigned long long)total, secs, total / secs, bytes / secs / (1 << 20),
+           (unsigned long long)errors);
+    printf("%-8s %10s %10s %10s %10s %10s %10s\n", "op", "count", "mean", "p50", "p99", "p999", "max");
+    for (op=0; op < NOPS; op++) {
+        if (hist[op].count == 0) {
+            continue;
+        }
+        printf("%-8s %10llu %8.0fus %8lluus %8lluus %8lluus %8lluus\n", op_names[op],
+               (unsigned long long)hist[op].count, (double)hist[op].sum / hist[op].count,
+               (unsigned long long)hist_percentile(&hist[op], 0.5),
+               (unsigned long long)hist_percentile(&hist[op], 0.99),
+               (unsigned long long)hist_percentile(&hist[op], 0.999),
+               (unsigned long long)hist[op].max);
+    }
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: loadgen [-h host] [-p port] [-c connections] [-t seconds]\n"
+                    "               [-n namespaces] [-k words] [-s skew] [-w write fraction] [-l limit]\n"
+                    "               [-r capture [-x speed]] [-o histograms] [-b baseline histograms]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct worker *workers;
+    struct histogram total[NOPS], base[NOPS];
+    uint64_t start, errors = 0, bytes = 0;
+    int ch, i, op;
+
+    while ((ch = getopt(argc, argv, "h:p:c:t:n:k:s:w:l:r:x:o:b:")) != -1) {
+        switch (ch) {
+            case 'h':
+                host = optarg;
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case 'c':
+                concurrency = atoi(optarg);
+                break;
+            case 't':
+                duration = atoi(optarg);
+                break;
+            case 'n':
+                nnamespaces = atoi(optarg);
+                break;
+            case 'k':
+                nwords = atoi(optarg);
+                break;
+            case 's':
+                skew = strtod(optarg, NULL);
+                break;
+            case 'w':
+                write_frac = strtod(optarg, NULL);
+                break;
+            case 'l':
+                limit = atoi(optarg);
+                break;
+            case 'r':
+                replay_file = optarg;
+                break;
+            case 'x':
+                speed = strtod(optarg, NULL);
+                break;
+            case 'o':
+                out_file = optarg;
+                break;
+            case 'b':
+                baseline_file = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (concurrency < 1 || duration < 1 || nnamespaces < 1 || nwords < 1) {
+        usage();
+    }
+
+    if (baseline_file && load_histograms(baseline_file, base) == -1) {
+        return 1;
+    }
+    if (replay_file) {
+        if (load_replay(replay_file) <= 0) {
+            fprintf(stderr, "Nothing to replay in %s\n", replay_file);
+            return 1;
+        }
+    } else {
+        zipf_init(&ns_dist, nnamespaces, skew);
+        zipf_init(&word_dist, nwords, skew);
+        make_words(nwords);
+    }
+
+    workers = calloc(concurrency, sizeof(*workers));
+    start = replay_start = now_usec();
+    for (i=0; i < concurrency; i++) {
+        workers[i].fd = -1;
+        workers[i].seed = 0x2545f4914f6cdd1dULL * (i + 1);
+        workers[i].bufsize = 16384;
+        workers[i].buf = malloc(workers[i].bufsize);
+        pthread_create(&workers[i].thread, NULL, replay_file ? replay_thread : worker_thread, &workers[i]);
+    }
+    if (!replay_file) {
+        sleep(duration);
+        stopping = 1;
+    }
+
+    memset(total, 0, sizeof(total));
+    for (i=0; i < concurrency; i++) {
+        pthread_join(workers[i].thread, NULL);
+        for (op=0; op < NOPS; op++) {
+            hist_merge(&total[op], &workers[i].hist[op]);
+        }
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        if (workers[i].fd != -1) {
+            close(workers[i].fd);
+        }
+        free(workers[i].buf);
+    }
+    report(total, errors, bytes, (now_usec() - start) / 1000000.0);
+    if (out_file) {
+        save_histograms(out_file, total);
+    }
+    if (baseline_file) {
+        compare(base, total);
+    }
+    return errors ? 2 : 0;
+}
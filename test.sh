@@ -6,3 +6,14 @@ for k in {'one','two','three','four','ten','twenty','twenty'}; do
 done
 curl "localhost:8080/del?namespace=foo&key=twenty"
 curl "localhost:8080/search?namespace=foo&key=tw"
+curl "localhost:8080/msearch?key=tw&namespace=foo&namespace=bar&key=t&limit=1"
+curl "localhost:8080/put?namespace=foo&key=temp&ttl=60"
+curl "localhost:8080/nuke?namespace=foo&key=tw&id=123"
+curl "localhost:8080/search?namespace=foo&key=t"
+for k in {'new+york','yorkshire','york+road'}; do
+    curl "localhost:8080/put?namespace=bar&key=${k}"
+done
+curl "localhost:8080/search?namespace=bar&key=york&match=word"
+curl "localhost:8080/search?namespace=bar&key=yotk&fuzzy=1"
+curl "localhost:8080/config?namespace=bar&infix=1"
+curl "localhost:8080/search?namespace=bar&key=ork&match=infix"